@@ -1,57 +1,263 @@
-#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "arena.h"
 
+/* Prepended to every stb_ds allocation so that it can be grown and released
+ * by whoever allocated it, regardless of the array arena active at the time */
+typedef struct {
+	MemoryBlock *arena; /* NULL for heap allocations */
+	long         size;
+} ArrayHeader;
+
+/* per thread, so that the lexer threads each fill arrays of their own */
+static __thread MemoryBlock *array_arena;
+
+static long
+PageSize(int flags)
+{
+	return flags & ARENA_HUGE_PAGES ? ARENA_HUGE_PAGE : ARENA_PAGE;
+}
+
+static long
+FirstChunk(int flags)
+{
+	return PageSize(flags) > ARENA_CHUNK ? PageSize(flags) : ARENA_CHUNK;
+}
+
+/* Reserves `size` bytes of address space; nothing is committed until the
+ * first allocation */
 MemoryBlock *
-CreateArena()
+CreateArena(long size, int flags)
 {
 	MemoryBlock *arena = malloc(sizeof(MemoryBlock));
+	long         page  = PageSize(flags);
+	long         head, tail;
+	char        *map;
+
+	size = (size + page - 1) & ~(page - 1);
+
+	/* huge pages need a block aligned to their size, so map a page more and
+	 * trim whatever falls outside of the aligned range */
+	map = mmap(NULL, size + page - ARENA_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(100);
+	}
 
-	arena->block = mmap(NULL, pow(1024, 3), PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	arena->block = (char *)(((unsigned long)map + page - 1) & ~(page - 1));
 
-	// MemoryBlock *arena = malloc(sizeof(MemoryBlock));
-	// arena->next = NULL;
-	arena->free = 0;
+	head = arena->block - map;
+	tail = page - ARENA_PAGE - head;
+	if (head) munmap(map, head);
+	if (tail) munmap(arena->block + size, tail);
+
+#ifdef MADV_HUGEPAGE
+	if (flags & ARENA_HUGE_PAGES) madvise(arena->block, size, MADV_HUGEPAGE);
+#endif
+
+	arena->free      = 0;
+	arena->committed = 0;
+	arena->chunk     = FirstChunk(flags);
+	arena->size      = size;
+	arena->flags     = flags;
+	arena->parent    = NULL;
+
+	arena->allocations = 0;
+	arena->requested   = 0;
+	arena->allocated   = 0;
+	arena->peak        = 0;
+	return arena;
+}
+
+/* Reserves `size` bytes of the parent's address space for a child arena. The
+ * child commits its own pages, shares the parent's flags and is released
+ * together with the parent */
+MemoryBlock *
+CreateSubArena(MemoryBlock *parent, long size)
+{
+	MemoryBlock *arena = malloc(sizeof(MemoryBlock));
+	long         page  = PageSize(parent->flags);
+	long         start = (parent->free + page - 1) & ~(page - 1);
+
+	if (start + size > parent->size) {
+		fprintf(stderr, "Arena exhausted (%ld bytes reserved)\n", parent->size);
+		exit(100);
+	}
+
+	*arena = (MemoryBlock){.block  = parent->block + start,
+	                       .size   = size,
+	                       .flags  = parent->flags,
+	                       .chunk  = FirstChunk(parent->flags),
+	                       .parent = parent};
+
+	parent->free = start + size;
 	return arena;
 }
 
 void
 DestroyArena(MemoryBlock *arena)
 {
-	// sleep(1);
-	munmap(arena->block, pow(1024, 3));
+	if (!arena->parent) munmap(arena->block, arena->size);
 	free(arena);
+}
+
+static void
+Prefault(char *address, long size)
+{
+	long offset;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(address, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+
+	/* older kernels: touch every page ourselves */
+	for (offset = 0; offset < size; offset += ARENA_PAGE) address[offset] = 0;
+}
 
-	// MemoryBlock *tmp;
-	// do {
-	// 	tmp = arena->next;
-	// 	free(arena);
-	// 	arena = tmp;
-	// } while (tmp);
+/* Makes at least `end` bytes of the block usable, committing whole chunks so
+ * that the kernel is only involved once a chunk runs out */
+static void
+Commit(MemoryBlock *arena, long end)
+{
+	long size = arena->chunk;
+
+	while (arena->committed + size < end) size *= 2;
+	if (arena->committed + size > arena->size) size = arena->size - arena->committed;
+	if (arena->committed + size < end) {
+		fprintf(stderr, "Arena exhausted (%ld bytes reserved)\n", arena->size);
+		exit(100);
+	}
+
+	mprotect(arena->block + arena->committed, size, PROT_READ | PROT_WRITE);
+	if (arena->flags & ARENA_PREFAULT) Prefault(arena->block + arena->committed, size);
+
+	arena->committed += size;
+	if (arena->chunk < ARENA_MAX_CHUNK) arena->chunk *= 2;
 }
 
 void *
 ArenaAlloc(MemoryBlock *arena, int len)
 {
 	void *address;
+
+	arena->allocations++;
+	arena->requested += len;
+
 	if (len % 8) len += 8 - len % 8;
 
-	// while (sizeof(arena->block) - arena->free < len) {
-	// 	if (arena->next) arena = arena->next;
-	// 	else {
-	// 		arena->next       = malloc(sizeof(MemoryBlock));
-	// 		arena->next->next = NULL;
-	// 		arena->next->free = 0;
-	// 		arena             = arena->next;
-	// 	}
-	// }
+	if (arena->free + len > arena->committed) Commit(arena, arena->free + len);
 
 	address = arena->block + arena->free;
 
-	mprotect(address, len, PROT_READ | PROT_WRITE);
-
 	arena->free += len;
+	arena->allocated += len;
+	if (arena->free > arena->peak) arena->peak = arena->free;
+
 	return address;
 }
+
+void
+PrintArenaStatsHeader()
+{
+	fprintf(stderr, "%-10s %10s %12s %12s %10s %12s %12s\n", "arena", "allocs",
+	        "requested", "rounded", "pages", "peak", "reserved");
+}
+
+void
+PrintArenaStats(char *name, MemoryBlock *arena)
+{
+	fprintf(stderr, "%-10s %10ld %12ld %12ld %10ld %12ld %12ld\n", name,
+	        arena->allocations, arena->requested, arena->allocated,
+	        arena->committed / ARENA_PAGE, arena->peak, arena->size);
+}
+
+long
+ArenaMark(MemoryBlock *arena)
+{
+	return arena->free;
+}
+
+/* Drops everything allocated since `mark`; the pages stay committed so the
+ * memory is handed out again without another mprotect */
+void
+ArenaReset(MemoryBlock *arena, long mark)
+{
+	arena->free = mark;
+}
+
+/* Selects where new stb_ds arrays are allocated, NULL meaning the heap.
+ * Returns the previous arena so that callers can restore it */
+MemoryBlock *
+SetArrayArena(MemoryBlock *arena)
+{
+	MemoryBlock *previous = array_arena;
+	array_arena           = arena;
+	return previous;
+}
+
+static int
+IsLastAllocation(ArrayHeader *header)
+{
+	long end = (char *)(header + 1) - header->arena->block + header->size;
+	if (end % 8) end += 8 - end % 8;
+	return end == header->arena->free;
+}
+
+void *
+ArrayRealloc(void *ptr, size_t size)
+{
+	ArrayHeader *header = ptr ? (ArrayHeader *)ptr - 1 : NULL;
+	ArrayHeader *copy;
+	MemoryBlock *arena;
+	long         end;
+
+	if (header && !header->arena) {
+		header       = realloc(header, sizeof(ArrayHeader) + size);
+		header->size = size;
+		return header + 1;
+	}
+
+	if (!header && !array_arena) {
+		header  = malloc(sizeof(ArrayHeader) + size);
+		*header = (ArrayHeader){.arena = NULL, .size = size};
+		return header + 1;
+	}
+
+	/* the most recent allocation of an arena grows in place, which is not
+	 * another allocation and only asks for the bytes it gains */
+	if (header && IsLastAllocation(header)) {
+		arena = header->arena;
+		end   = (char *)(header + 1) - arena->block + size;
+		if (end % 8) end += 8 - end % 8;
+
+		if (end > arena->committed) Commit(arena, end);
+		if (size > header->size) arena->requested += size - header->size;
+		if (end > arena->free) arena->allocated += end - arena->free;
+
+		arena->free = end;
+		if (arena->free > arena->peak) arena->peak = arena->free;
+
+		header->size = size;
+		return header + 1;
+	}
+
+	copy  = ArenaAlloc(header ? header->arena : array_arena, sizeof(ArrayHeader) + size);
+	*copy = (ArrayHeader){.arena = header ? header->arena : array_arena, .size = size};
+	if (header) memcpy(copy + 1, ptr, header->size < size ? header->size : size);
+	return copy + 1;
+}
+
+void
+ArrayFree(void *ptr)
+{
+	ArrayHeader *header = ptr ? (ArrayHeader *)ptr - 1 : NULL;
+
+	if (!header) return;
+	if (!header->arena) free(header);
+	else if (IsLastAllocation(header)) {
+		ArenaReset(header->arena, (char *)header - header->arena->block);
+	}
+}
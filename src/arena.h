@@ -1,14 +1,63 @@
 #ifndef arena_h
 #define arena_h
 
+#include <stddef.h>
+
+#ifdef INCLUDE_STB_DS_H
+#error "arena.h has to be included before stb_ds.h"
+#endif
+
+/* stb_ds arrays and hashmaps are allocated through the array arena, see
+ * SetArrayArena */
+#define STBDS_REALLOC(context, ptr, size) ArrayRealloc(ptr, size)
+#define STBDS_FREE(context, ptr)          ArrayFree(ptr)
+
+#define ARENA_SIZE (1L << 30) /* default address space reserved per session */
+#define ARENA_MAX_SIZE (1L << 40) /* largest --arena-size */
+#define ARENA_PAGE 4096
+#define ARENA_HUGE_PAGE (1L << 21)
+#define ARENA_CHUNK (1L << 16) /* first commit, doubles up to ARENA_MAX_CHUNK */
+#define ARENA_MAX_CHUNK (1L << 26)
+
+/* clang-format off */
+typedef enum {
+	ARENA_HUGE_PAGES = 1 << 0, /* back the block with transparent huge pages */
+	ARENA_PREFAULT   = 1 << 1, /* fault committed pages in right away */
+} ArenaFlags;
+/* clang-format on */
+
 typedef struct MemoryBlock {
-	int                 free;
-	// struct MemoryBlock *next;
-	char               *block/*[1024]*/;
+	long  free;      /* offset of the first unused byte */
+	long  committed; /* bytes already readable and writable */
+	long  chunk;     /* size of the next commit */
+	long  size;      /* bytes of address space reserved */
+	int   flags;
+	char *block;
+
+	/* statistics */
+	long allocations;
+	long requested; /* bytes asked for */
+	long allocated; /* bytes handed out after rounding */
+	long peak;      /* highest value of free */
+
+	/* set for sub-arenas, whose block is carved out of the parent's
+	 * reservation instead of being mapped on its own */
+	struct MemoryBlock *parent;
 } MemoryBlock;
 
-MemoryBlock *CreateArena();
+MemoryBlock *CreateArena(long, int);
+MemoryBlock *CreateSubArena(MemoryBlock *, long);
 void         DestroyArena(MemoryBlock *);
 void        *ArenaAlloc(MemoryBlock *, int);
 
+void PrintArenaStatsHeader();
+void PrintArenaStats(char *, MemoryBlock *);
+
+long ArenaMark(MemoryBlock *);
+void ArenaReset(MemoryBlock *, long);
+
+MemoryBlock *SetArrayArena(MemoryBlock *);
+void        *ArrayRealloc(void *, size_t);
+void         ArrayFree(void *);
+
 #endif /* !arena_h */
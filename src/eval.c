@@ -1,21 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "eval.h"
+#include "optimize.h"
 #include "stb_ds.h"
-
-ValueItem **stack;
+#include "trace.h"
 
 Evaluator *
-CreateEvaluator(Statement *program)
+CreateEvaluator(MemoryBlock *arena, MemoryBlock *frames, Ast *ast)
 {
-	MemoryBlock *arena = CreateArena();
-
 	Evaluator *eval = ArenaAlloc(arena, sizeof(Evaluator));
-	*eval = (Evaluator){.arena = arena, .program = program, .stack = NULL};
-
-	arrpush(eval->stack, NULL);
-	shdefault(eval->stack[0], (Value){.type = VAL_NONE});
+	*eval           = (Evaluator){.arena   = arena,
+	                              .frames  = frames,
+	                              .symbols = ast->symbols,
+	                              .ast     = ast};
+
+	/* the globals and the stack last as long as the evaluator, calls put
+	 * their slots in the frames arena */
+	MemoryBlock *outer = SetArrayArena(arena);
+	arrsetcap(eval->globals, arrlen(ast->symbols->names) + 64);
+	arrsetcap(eval->stack, 64);
+	arrsetcap(eval->temporaries, 64);
+	SetArrayArena(outer);
 
 	return eval;
 }
@@ -23,60 +30,110 @@ CreateEvaluator(Statement *program)
 void
 DestroyEvaluator(Evaluator *eval)
 {
-	shfree(eval->stack[0]);
+	arrfree(eval->globals);
 	arrfree(eval->stack);
-	DestroyArena(eval->arena);
+	arrfree(eval->temporaries);
+}
+
+/* Inside a call names are bound in the slots Resolve gave them, at the
+ * top level in the globals, which grow with the symbol table */
+static void
+Bind(Evaluator *eval, int top, int slot, int symbol, Value value)
+{
+	int count = arrlen(eval->globals);
+
+	if (top >= 0) {
+		eval->stack[top].slots[slot] = value;
+		return;
+	}
+
+	if (symbol >= count) {
+		arrsetlen(eval->globals, symbol + 1);
+		memset(eval->globals + count, 0, (symbol + 1 - count) * sizeof(Value));
+	}
+	eval->globals[symbol] = value;
 }
 
+/* Nodes are copied out of the pools, which may move while a call runs */
 void
-Eval(Evaluator *eval, Statement *statements)
+Eval(Evaluator *eval, int block)
 {
-	int top = arrlen(eval->stack) - 1;
+	Ast           *ast  = eval->ast;
+	BlockStatement body = ast->blocks[block];
+	int            top  = arrlen(eval->stack) - 1;
+	int            i;
 
-	puts("\n\n==== EVAL ====");
-	int i;
-	for (i = 0; statements[i].type != STAT_INVALID; i++) {
-		// PrintStatement(&statements[i]);
-		switch (statements[i].type) {
+	TRACE(TRACE_EVAL, top >= 0 ? TRACE_VERBOSE : TRACE_BRIEF, "\n\n==== EVAL ====\n");
+	for (i = body.first; i < body.first + body.count; i++) {
+		Statement statement = ast->statements[i];
+
+		switch (statement.type) {
 		case STAT_LET: {
-			LetStatement statement  = statements[i].let;
-			char        *identifier = statement.identifier->value;
-			Value        value      = EvalExpression(eval, statement.value);
-			shput(eval->stack[top], identifier, value);
+			Value value = EvalExpression(eval, statement.let.value);
+			Bind(eval, top, statement.slot, statement.let.identifier, value);
 		} break;
 		case STAT_PROC: {
-			ProcStatement *statement = &statements[i].proc;
-			Value          value = {.type = VAL_PROC, .procedure = statement};
-			shput(eval->stack[top], statement->identifier->value, value);
+			Value value = {.type = VAL_PROC, .procedure = i, .environment = top};
+			Bind(eval, top, statement.slot, statement.proc.identifier, value);
 		} break;
 		case STAT_RETURN: {
-			Value value = EvalExpression(eval, statements->return_.value);
-			shput(eval->stack[top], "_return_val", value);
+			Value value = EvalExpression(eval, statement.return_.value);
+			if (top < 0) return;
+
+			/* the frame a nested proc reads is gone once it returns */
+			if (value.type == VAL_PROC && value.environment == top) {
+				fprintf(stderr, "Procedure returned out of its scope: %s\n",
+				        SymbolName(eval->symbols, ast->statements[value.procedure].proc.identifier));
+				exit(300);
+			}
+			eval->stack[top].returned = value;
 			return;
 		}
-		case STAT_EXPR:
-			EvalExpression(eval, statements[i].expression.expression);
-			break;
+		case STAT_EXPR: {
+			Value value = EvalExpression(eval, statement.expression.expression);
+			if (top < 0) eval->result = value;
+		} break;
 		default: break;
 		}
 	}
+}
+
+void
+PrintVariable(Evaluator *eval, char *name)
+{
+	int symbol = FindSymbol(eval->symbols, name, strlen(name));
+
+	if (symbol < 0) {
+		fprintf(stderr, "Undeclared identifier: %s\n", name);
+		exit(300);
+	}
+	printf("%s: %d\n", name,
+	       GetValue(eval, (IdentifierExpression){symbol, SCOPE_GLOBAL}).integer);
+}
 
-	if (top == 0) printf("z: %d\n", GetValue(eval, "z").integer);
+/* Frames of enclosing procs are found by following the parents, which are
+ * the calls that defined the procs. Returns -1 for the globals */
+static int
+FrameAt(Evaluator *eval, int depth)
+{
+	int frame = arrlen(eval->stack) - 1;
+
+	if (depth == SCOPE_GLOBAL) return -1;
+	for (; depth > 0; depth--) frame = eval->stack[frame].parent;
+	return frame;
 }
 
 Value
-GetValue(Evaluator *eval, char *identifier)
+GetValue(Evaluator *eval, IdentifierExpression identifier)
 {
-	Value value;
+	Value value = {.type = VAL_NONE};
+	int   frame = FrameAt(eval, identifier.depth);
 
-	int frame;
-	for (frame = arrlen(eval->stack) - 1; frame >= 0; frame--) {
-		value = shget(eval->stack[frame], identifier);
-		if (value.type != VAL_NONE) break;
-	}
+	if (frame >= 0) value = eval->stack[frame].slots[identifier.slot];
+	else if (identifier.symbol < arrlen(eval->globals)) value = eval->globals[identifier.symbol];
 
 	if (value.type == VAL_NONE) {
-		fprintf(stderr, "Undeclared identifier: %s\n", identifier);
+		fprintf(stderr, "Undeclared identifier: %s\n", SymbolName(eval->symbols, identifier.symbol));
 		exit(300);
 	}
 
@@ -84,68 +141,110 @@ GetValue(Evaluator *eval, char *identifier)
 }
 
 Value
-EvalExpression(Evaluator *eval, Expression *expression)
+EvalExpression(Evaluator *eval, int index)
 {
-	Value value;
-
-	switch (expression->type) {
-	case EXPR_IDENTIFIER:
-		value = GetValue(eval, expression->identifier.value->value);
-		break;
-	case EXPR_LITERAL: {
-		Token *token = expression->literal.value;
-		if (token->type == TOK_INTEGER) {
-			value.type    = VAL_INTEGER;
-			value.integer = atoi(token->value);
-		} else if (token->type == TOK_STRING) {
-			value.type   = VAL_STRING;
-			value.string = token->value;
-		} else exit(300);
+	Ast       *ast        = eval->ast;
+	Expression expression = ast->expressions[index];
+	Value      value;
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER: value = GetValue(eval, expression.identifier); break;
+	case EXPR_LITERAL: value = ast->constants[expression.literal.constant]; break;
+	case EXPR_PREFIX: {
+		value.type = VAL_INTEGER;
+		int value1 = EvalExpression(eval, expression.prefix.value).integer;
+
+		if (expression.operator == TOK_MINUS) {
+			value.integer = -value1;
+		} else if (expression.operator == TOK_NOT) {
+			value.integer = !value1;
+		}
 	} break;
 	case EXPR_INFIX: {
-		InfixExpression infix = expression->infix;
-
 		value.type = VAL_INTEGER;
-		int value1 = EvalExpression(eval, infix.value1).integer;
-		int value2 = EvalExpression(eval, infix.value2).integer;
+		int value1 = EvalExpression(eval, expression.infix.value1).integer;
+		int value2 = EvalExpression(eval, expression.infix.value2).integer;
 
-		if (infix.operator->type == TOK_PLUS) {
+		if (expression.operator == TOK_PLUS) {
 			value.integer = value1 + value2;
-		} else if (infix.operator->type == TOK_MINUS) {
+		} else if (expression.operator == TOK_MINUS) {
 			value.integer = value1 - value2;
-		} else if (infix.operator->type == TOK_STAR) {
+		} else if (expression.operator == TOK_STAR) {
 			value.integer = value1 * value2;
-		} else if (infix.operator->type == TOK_SLASH) {
+		} else if (expression.operator == TOK_SLASH) {
 			value.integer = value1 / value2;
+		} else if (expression.operator == OP_SHIFT_LEFT) {
+			value.integer = (unsigned)value1 << value2;
+		}
+	} break;
+	case EXPR_SHARED: {
+		int slot = eval->base + expression.shared.slot;
+
+		if (expression.shared.value < 0) {
+			value = eval->temporaries[slot];
+		} else {
+			value = EvalExpression(eval, expression.shared.value);
+			if (slot >= arrlen(eval->temporaries)) arrsetlen(eval->temporaries, slot + 1);
+			eval->temporaries[slot] = value;
 		}
 	} break;
 	case EXPR_CALL: {
-		CallExpression call       = expression->call;
-		char          *identifier = call.procedure->value;
-		Value          proc       = GetValue(eval, identifier);
-
-		if (call.arity != proc.procedure->arity) {
-			fprintf(stderr, "Artity mismatch\n");
-			exit(300);
+		Expression callee = ast->expressions[expression.call.callee];
+		Statement  procedure;
+		Value      proc;
+
+		if (callee.type == EXPR_PROCEDURE) {
+			/* linked by Resolve, which checked the arity */
+			proc = (Value){.type        = VAL_PROC,
+			               .procedure   = callee.procedure.statement,
+			               .environment = FrameAt(eval, callee.procedure.depth)};
+			procedure = ast->statements[proc.procedure];
+		} else {
+			proc = GetValue(eval, callee.identifier);
+			if (proc.type != VAL_PROC) {
+				fprintf(stderr, "Not a procedure: %s\n",
+				        SymbolName(eval->symbols, callee.identifier.symbol));
+				exit(300);
+			}
+			procedure = ast->statements[proc.procedure];
+
+			if (expression.arity != procedure.arity) {
+				fprintf(stderr, "Artity mismatch\n");
+				exit(300);
+			}
 		}
 
-		int top = arrlen(eval->stack);
-		arrpush(eval->stack, NULL);
-		shdefault(eval->stack[top], (Value){.type = VAL_NONE});
+		/* the size of the frame is known once the body is resolved */
+		if (ast->blocks[procedure.proc.body].first < 0)
+			ParseSkippedBlock(ast->parser, procedure.proc.body);
 
+		long  mark   = ArenaMark(eval->frames);
+		int   locals = ast->blocks[procedure.proc.body].locals;
+		Frame frame  = {.slots  = ArenaAlloc(eval->frames, locals * sizeof(Value)),
+		                .parent = proc.environment};
+		memset(frame.slots, 0, locals * sizeof(Value));
+
+		/* arguments are evaluated in the frame of the caller */
 		int i;
-		for (i = 0; i < call.arity; i++) {
-			char *argument = proc.procedure->arguments[i]->value;
-			Value value    = EvalExpression(eval, call.arguments[i]);
-			printf("%s = %d\n", argument, value.integer);
-			shput(eval->stack[top], argument, value);
+		for (i = 0; i < expression.arity; i++) {
+			int argument   = ast->lists[procedure.proc.arguments + i];
+			frame.slots[i] = EvalExpression(eval, ast->lists[expression.call.arguments + i]);
+			TRACE(TRACE_CALL, TRACE_BRIEF, "%s = %d\n", SymbolName(eval->symbols, argument),
+			      frame.slots[i].integer);
 		}
 
-		Eval(eval, proc.procedure->body->statements);
-		value = shget(eval->stack[top], "_return_val");
-
-		shfree(eval->stack[top]);
-		arrpop(eval->stack);
+		/* slots of the caller that are still to be read stay below */
+		int base   = eval->base;
+		eval->base = arrlen(eval->temporaries);
+		arrpush(eval->stack, frame);
+		Eval(eval, procedure.proc.body);
+		value = arrpop(eval->stack).returned;
+		arrsetlen(eval->temporaries, eval->base);
+		eval->base = base;
+		TRACE(TRACE_CALL, TRACE_VERBOSE, "%s returned %d\n",
+		      SymbolName(eval->symbols, procedure.proc.identifier), value.integer);
+
+		ArenaReset(eval->frames, mark);
 	} break;
 	default: exit(300);
 	}
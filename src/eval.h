@@ -3,36 +3,31 @@
 
 #include "parse.h"
 
+/* The slots of an active call, laid out by Resolve */
 typedef struct {
-	enum {
-		VAL_NONE,
-		VAL_PROC,
-		VAL_INTEGER,
-		VAL_STRING,
-	} type;
-	union {
-		ProcStatement *procedure;
-		int            integer;
-		char          *string;
-	};
-} Value;
+	Value *slots;
+	int    parent;   /* frame of the call the proc was defined in, or -1 */
+	Value  returned;
+} Frame;
 
 typedef struct {
-	char *key;
-	Value value;
-} ValueItem;
-
-typedef struct {
-	Statement   *program;
-	ValueItem  **stack;
+	Ast         *ast;
+	SymbolTable *symbols;
+	Value       *globals;     /* by symbol */
+	Frame       *stack;       /* active calls, innermost on top */
+	Value       *temporaries; /* slots of shared expressions, see Optimize */
+	int          base;        /* of the slots of the current call */
 	MemoryBlock *arena;
+	MemoryBlock *frames; /* slots of active calls, recycled on return */
+	Value        result; /* of the last expression statement outside a proc */
 } Evaluator;
 
-Evaluator *CreateEvaluator(Statement *);
+Evaluator *CreateEvaluator(MemoryBlock *, MemoryBlock *, Ast *);
 void       DestroyEvaluator(Evaluator *);
 
-void  Eval(Evaluator *, Statement *);
-Value EvalExpression(Evaluator *, Expression *);
-Value GetValue(Evaluator *, char *);
+void  Eval(Evaluator *, int);
+Value EvalExpression(Evaluator *, int);
+Value GetValue(Evaluator *, IdentifierExpression);
+void  PrintVariable(Evaluator *, char *);
 
 #endif /* !eval_h */
@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "stb_ds.h"
+
+#include "image.h"
+
+enum { POOL_EXPRESSIONS, POOL_STATEMENTS, POOL_BLOCKS, POOL_LISTS, POOL_CONSTANTS, POOLS };
+
+/* Followed by the pools, then the offsets and the terminated names of the
+ * symbols, each section starting at a multiple of 8 bytes. Strings among the
+ * constants are stored as their symbol */
+typedef struct {
+	char          magic[4];
+	unsigned int  version;
+	unsigned long hash;
+	long          size; /* of the source */
+	unsigned char layout[POOLS];
+	int           program;
+	int           counts[POOLS];
+	int           symbols;
+	int           names; /* bytes */
+} ImageHeader;
+
+static const char magic[4] = {'P', 'S', 'D', 'I'};
+
+static const unsigned char layout[POOLS] = {
+	[POOL_EXPRESSIONS] = sizeof(Expression),
+	[POOL_STATEMENTS]  = sizeof(Statement),
+	[POOL_BLOCKS]      = sizeof(BlockStatement),
+	[POOL_LISTS]       = sizeof(int),
+	[POOL_CONSTANTS]   = sizeof(Value),
+};
+
+static long
+Align(long offset)
+{
+	return (offset + 7) & ~7L;
+}
+
+/* FNV-1a of the source, then of the options that change the tree */
+unsigned long
+HashSource(char *source, long size, int options)
+{
+	unsigned long hash = 14695981039346656037UL;
+	long          i;
+
+	for (i = 0; i < size; i++) hash = (hash ^ (unsigned char)source[i]) * 1099511628211UL;
+	for (i = 0; i < (long)sizeof(options); i++)
+		hash = (hash ^ (unsigned char)(options >> i * 8)) * 1099511628211UL;
+	return hash;
+}
+
+char *
+ImagePath(MemoryBlock *arena, char *directory, unsigned long hash)
+{
+	int   length = strlen(directory) + 24;
+	char *path   = ArenaAlloc(arena, length);
+
+	snprintf(path, length, "%s/%016lx.ast", directory, hash);
+	return path;
+}
+
+/* Maps the image at `path` and rebuilds the symbol table from it. Returns
+ * NULL when there is no image for the source or it was made by another
+ * build */
+Ast *
+LoadImage(MemoryBlock *arena, SymbolTable *symbols, char *path, unsigned long hash, long size)
+{
+	struct stat  info;
+	ImageHeader *header;
+	Ast         *ast;
+	char        *image, *names;
+	int         *offsets;
+	long         offset, end;
+	int          fd, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+	if (fstat(fd, &info) < 0 || info.st_size < (long)sizeof(ImageHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* private and writable, constants get their string pointers back */
+	image = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) return NULL;
+
+	header = (ImageHeader *)image;
+	end    = Align(sizeof(ImageHeader));
+	for (i = 0; i < POOLS; i++) end = Align(end + (long)header->counts[i] * layout[i]);
+	end = Align(end + header->symbols * sizeof(int)) + header->names;
+
+	if (memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != IMAGE_VERSION ||
+	    memcmp(header->layout, layout, sizeof(layout)) != 0 || header->hash != hash ||
+	    header->size != size || end > info.st_size) {
+		munmap(image, info.st_size);
+		return NULL;
+	}
+
+	ast  = ArenaAlloc(arena, sizeof(Ast));
+	*ast = (Ast){.symbols    = symbols,
+	             .program    = header->program,
+	             .image      = image,
+	             .image_size = info.st_size};
+
+	offset           = Align(sizeof(ImageHeader));
+	ast->expressions = (Expression *)(image + offset);
+	offset           = Align(offset + header->counts[POOL_EXPRESSIONS] * sizeof(Expression));
+	ast->statements  = (Statement *)(image + offset);
+	offset           = Align(offset + header->counts[POOL_STATEMENTS] * sizeof(Statement));
+	ast->blocks      = (BlockStatement *)(image + offset);
+	offset           = Align(offset + header->counts[POOL_BLOCKS] * sizeof(BlockStatement));
+	ast->lists       = (int *)(image + offset);
+	offset           = Align(offset + header->counts[POOL_LISTS] * sizeof(int));
+	ast->constants   = (Value *)(image + offset);
+	offset           = Align(offset + header->counts[POOL_CONSTANTS] * sizeof(Value));
+	offsets          = (int *)(image + offset);
+	names            = image + Align(offset + header->symbols * sizeof(int));
+
+	/* interned in their order, the symbols get the ids they were saved with */
+	for (i = 0; i < header->symbols; i++) {
+		if (Intern(symbols, names + offsets[i], strlen(names + offsets[i])) != i) {
+			UnloadImage(ast);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < header->counts[POOL_CONSTANTS]; i++) {
+		if (ast->constants[i].type == VAL_STRING)
+			ast->constants[i].string = SymbolName(symbols, ast->constants[i].integer);
+	}
+
+	return ast;
+}
+
+/* Writes `size` bytes and pads them to the next section, returns non-zero
+ * on failure */
+static int
+WriteSection(FILE *file, void *data, long size)
+{
+	static const char padding[8];
+	long              length;
+
+	if (size && fwrite(data, 1, size, file) != size) return 1;
+	length = Align(ftell(file)) - ftell(file);
+	return fwrite(padding, 1, length, file) != length;
+}
+
+/* Writes the image next to its final path and renames it into place, so
+ * that concurrent runs never see a partial image. Bodies that were skipped
+ * are parsed first, an image always holds the whole program */
+void
+SaveImage(Ast *ast, char *path, unsigned long hash, long size)
+{
+	ImageHeader header = {.version = IMAGE_VERSION,
+	                      .hash    = hash,
+	                      .size    = size,
+	                      .program = ast->program};
+	SymbolTable *symbols = ast->symbols;
+	Value        constant;
+	FILE        *file;
+	char        *directory, *slash, temporary[4096];
+	int          offset, i, failed = 0;
+
+	if (ast->image) return;
+	if (ast->parser) ParseSkippedBlocks(ast->parser);
+
+	memcpy(header.magic, magic, sizeof(magic));
+	memcpy(header.layout, layout, sizeof(layout));
+	header.counts[POOL_EXPRESSIONS] = arrlen(ast->expressions);
+	header.counts[POOL_STATEMENTS]  = arrlen(ast->statements);
+	header.counts[POOL_BLOCKS]      = arrlen(ast->blocks);
+	header.counts[POOL_LISTS]       = arrlen(ast->lists);
+	header.counts[POOL_CONSTANTS]   = arrlen(ast->constants);
+	header.symbols                  = arrlen(symbols->names);
+	for (i = 0; i < header.symbols; i++) header.names += strlen(symbols->names[i]) + 1;
+
+	/* the directory is created on first use */
+	directory = strdup(path);
+	if ((slash = strrchr(directory, '/'))) {
+		*slash = '\0';
+		mkdir(directory, 0755);
+	}
+	free(directory);
+
+	snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid());
+	if (!(file = fopen(temporary, "wb"))) {
+		fprintf(stderr, "Could not write image \"%s\": %s\n", path, strerror(errno));
+		return;
+	}
+
+	failed |= WriteSection(file, &header, sizeof(header));
+	failed |= WriteSection(file, ast->expressions, header.counts[POOL_EXPRESSIONS] * sizeof(Expression));
+	failed |= WriteSection(file, ast->statements, header.counts[POOL_STATEMENTS] * sizeof(Statement));
+	failed |= WriteSection(file, ast->blocks, header.counts[POOL_BLOCKS] * sizeof(BlockStatement));
+	failed |= WriteSection(file, ast->lists, header.counts[POOL_LISTS] * sizeof(int));
+
+	for (i = 0; i < header.counts[POOL_CONSTANTS]; i++) {
+		constant = ast->constants[i];
+		if (constant.type == VAL_STRING) {
+			constant = (Value){.type    = VAL_STRING,
+			                   .integer = FindSymbol(symbols, constant.string,
+			                                         strlen(constant.string))};
+		}
+		failed |= fwrite(&constant, sizeof(Value), 1, file) != 1;
+	}
+	failed |= WriteSection(file, NULL, 0);
+
+	for (i = 0, offset = 0; i < header.symbols; i++) {
+		failed |= fwrite(&offset, sizeof(int), 1, file) != 1;
+		offset += strlen(symbols->names[i]) + 1;
+	}
+	failed |= WriteSection(file, NULL, 0);
+	for (i = 0; i < header.symbols; i++)
+		failed |= fwrite(symbols->names[i], strlen(symbols->names[i]) + 1, 1, file) != 1;
+
+	failed |= fclose(file) != 0;
+	if (failed || rename(temporary, path) != 0) {
+		fprintf(stderr, "Could not write image \"%s\": %s\n", path, strerror(errno));
+		unlink(temporary);
+	}
+}
+
+void
+UnloadImage(Ast *ast)
+{
+	munmap(ast->image, ast->image_size);
+	ast->image = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef image_h
+#define image_h
+
+#include "arena.h"
+#include "parse.h"
+
+/* A parsed program saved to disk, so that later runs of an unchanged script
+ * can skip lexing and parsing. Images are named after a hash of the source
+ * and are only used by a build with the same version and node layout */
+#define IMAGE_VERSION 5
+
+unsigned long HashSource(char *, long, int);
+char         *ImagePath(MemoryBlock *, char *, unsigned long);
+
+Ast  *LoadImage(MemoryBlock *, SymbolTable *, char *, unsigned long, long);
+void  SaveImage(Ast *, char *, unsigned long, long);
+void  UnloadImage(Ast *);
+
+#endif /* !image_h */
@@ -1,15 +1,16 @@
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "stb_ds.h"
 
 #include "lex.h"
 #include "utils.h"
 
-static char *TypeToString(TokenType);
-
 char *TokenNames[] = {
 	[TOK_EOF]        = "EOF",
 	[TOK_COMMENT]    = "COMMENT",
@@ -47,207 +48,490 @@ char *TokenNames[] = {
 	[TOK_INTEGER]    = "INTEGER",
 };
 
+/* Keywords are found with a perfect hash of their first and last character
+ * and their length, so classifying an identifier takes a single comparison.
+ * The hash has to stay collision free when keywords are added, which the
+ * compiler reports as an overridden initializer */
+#define KEYWORD_HASH(first, last, length) \
+	(((unsigned char)(first) + 7 * (unsigned char)(last) + (length)) & 15)
+
+static Symbol Keywords[16] = {
+	[KEYWORD_HASH('a', 'd', 3)] = {"and", TOK_AND},
+	[KEYWORD_HASH('b', 'k', 5)] = {"break", TOK_BREAK},
+	[KEYWORD_HASH('c', 'e', 8)] = {"continue", TOK_CONTINUE},
+	[KEYWORD_HASH('e', 'e', 4)] = {"else", TOK_ELSE},
+	[KEYWORD_HASH('f', 'r', 3)] = {"for", TOK_FOR},
+	[KEYWORD_HASH('i', 'f', 2)] = {"if", TOK_IF},
+	[KEYWORD_HASH('l', 't', 3)] = {"let", TOK_LET},
+	[KEYWORD_HASH('o', 'r', 2)] = {"or", TOK_OR},
+	[KEYWORD_HASH('p', 'c', 4)] = {"proc", TOK_PROC},
+	[KEYWORD_HASH('r', 'n', 6)] = {"return", TOK_RETURN},
+};
+
 static TokenType
-GetTokenType(char *string)
-{
-	switch (string[0]) {
-	case '(':
-		if (strlen(string) == 1) return TOK_L_PAREN;
-	case ')':
-		if (strlen(string) == 1) return TOK_R_PAREN;
-	case '{':
-		if (strlen(string) == 1) return TOK_L_BRACE;
-	case '}':
-		if (strlen(string) == 1) return TOK_R_BRACE;
-	case ',':
-		if (strlen(string) == 1) return TOK_COMMA;
-	case ';':
-		if (strlen(string) == 1) return TOK_SEMICOLON;
-	case '+':
-		if (strlen(string) == 1) return TOK_PLUS;
-	case '-':
-		if (strlen(string) == 1) return TOK_MINUS;
-	case '*':
-		if (strlen(string) == 1) return TOK_STAR;
-	case '/':
-		if (strlen(string) == 1) return TOK_SLASH;
-
-	case '=':
-		if (strcmp(string, "=") == 0) return TOK_ASSIGN;
-		if (strcmp(string, "==") == 0) return TOK_EQUAL;
-	case '!':
-		if (strcmp(string, "!") == 0) return TOK_NOT;
-		if (strcmp(string, "!=") == 0) return TOK_UNEQUAL;
-	case '<':
-		if (strcmp(string, "<") == 0) return TOK_LESSER;
-		if (strcmp(string, "<=") == 0) return TOK_LESSER_EQ;
-	case '>':
-		if (strcmp(string, ">") == 0) return TOK_GREATER;
-		if (strcmp(string, ">=") == 0) return TOK_GREATER_EQ;
-
-	case 'a':
-		if (strcmp(string, "and") == 0) return TOK_AND;
-	case 'b':
-		if (strcmp(string, "break") == 0) return TOK_BREAK;
-	case 'c':
-		if (strcmp(string, "continue") == 0) return TOK_CONTINUE;
-	case 'e':
-		if (strcmp(string, "else") == 0) return TOK_ELSE;
-	case 'f':
-		if (strcmp(string, "for") == 0) return TOK_FOR;
-	case 'i':
-		if (strcmp(string, "if") == 0) return TOK_IF;
-	case 'l':
-		if (strcmp(string, "let") == 0) return TOK_LET;
-	case 'o':
-		if (strcmp(string, "or") == 0) return TOK_OR;
-	case 'p':
-		if (strcmp(string, "proc") == 0) return TOK_PROC;
-	case 'r':
-		if (strcmp(string, "return") == 0) return TOK_RETURN;
+GetWordType(char *string, int length)
+{
+	Symbol *keyword = &Keywords[KEYWORD_HASH(string[0], string[length - 1], length)];
 
+	if (keyword->key && strncmp(keyword->key, string, length) == 0 &&
+	    keyword->key[length] == '\0')
+		return keyword->value;
+
+	return TOK_IDENTIFIER;
+}
+
+static TokenType
+GetOperatorType(char current, char peek)
+{
+	switch (current) {
+	case '(': return TOK_L_PAREN;
+	case ')': return TOK_R_PAREN;
+	case '{': return TOK_L_BRACE;
+	case '}': return TOK_R_BRACE;
+	case ',': return TOK_COMMA;
+	case ';': return TOK_SEMICOLON;
+	case '+': return TOK_PLUS;
+	case '-': return TOK_MINUS;
+	case '*': return TOK_STAR;
+	case '/': return TOK_SLASH;
+	case '=': return peek == '=' ? TOK_EQUAL : TOK_ASSIGN;
+	case '!': return peek == '=' ? TOK_UNEQUAL : TOK_NOT;
+	case '<': return peek == '=' ? TOK_LESSER_EQ : TOK_LESSER;
+	case '>': return peek == '=' ? TOK_GREATER_EQ : TOK_GREATER;
 	default: return TOK_EOF;
 	}
 }
 
 Lexer *
-CreateLexer(char *input)
+CreateLexer(MemoryBlock *arena, SymbolTable *symbols, char *input, int length)
 {
-	MemoryBlock *arena = CreateArena();
-
-	Lexer *lexer = ArenaAlloc(arena, sizeof(Lexer));
+	Lexer     *lexer  = ArenaAlloc(arena, sizeof(Lexer));
+	TokenList *tokens = ArenaAlloc(arena, sizeof(TokenList));
 
-	*lexer = (Lexer){.arena = arena, .input = input, .row = 1, .column = 1};
+	*tokens = (TokenList){.arena = arena, .input = input, .table = symbols};
+	*lexer  = (Lexer){.arena   = arena,
+	                  .symbols = symbols,
+	                  .input   = input,
+	                  .length  = length,
+	                  .scanner = GetScanner(),
+	                  .tokens  = tokens};
 
-	if ((lexer->current = input[lexer->position++])) {
-		lexer->peek = input[lexer->position++];
-	}
+	if ((lexer->current = input[0])) lexer->peek = input[1];
 
 	return lexer;
 }
 
-void
-DestroyLexer(Lexer *lexer)
+static void
+ReadChar(Lexer *lexer)
 {
-	DestroyArena(lexer->arena);
+	if (!lexer->current) return;
+
+	lexer->position++;
+
+	lexer->current = lexer->peek;
+	if (lexer->current) lexer->peek = lexer->input[lexer->position + 1];
 }
 
+/* Skips a run of characters found by one of the scanners */
 static void
-ReadChar(Lexer *lexer)
+Advance(Lexer *lexer, int count)
 {
-	lexer->column++;
+	lexer->position += count;
 
-	lexer->current = lexer->peek;
-	if (lexer->current) lexer->peek = lexer->input[lexer->position++];
+	lexer->current = lexer->input[lexer->position];
+	lexer->peek    = lexer->current ? lexer->input[lexer->position + 1] : '\0';
+}
+
+static int
+Remaining(Lexer *lexer)
+{
+	return lexer->length - lexer->position;
 }
 
-Token *
+static int
+Line(Lexer *lexer, int offset)
+{
+	int row, column;
+	GetPosition(lexer->tokens, offset, &row, &column);
+	return row;
+}
+
+Token
 NextToken(Lexer *lexer)
 {
-	Token *token = ArenaAlloc(lexer->arena, sizeof(Token));
-	char  *word  = NULL;
+	Token    token;
+	Scanner *scanner = lexer->scanner;
 
-	while (isspace(lexer->current)) {
-		if (lexer->current == '\n' || lexer->current == '\r') {
-			lexer->column = 1;
-			lexer->row++;
-		}
-		ReadChar(lexer);
+	if (isspace(lexer->current)) {
+		Advance(lexer, scanner->space(lexer->input + lexer->position, Remaining(lexer)));
 	}
 
-	*token = (Token){.row = lexer->row, .column = lexer->column};
+	token = (Token){.offset = lexer->position, .symbol = -1};
 
 	if (lexer->current == '\0') {
-		arrpush(word, 'E');
-		arrpush(word, 'O');
-		arrpush(word, 'F');
-		arrpush(word, '\0');
+		token.type = TOK_EOF;
 	} else if (lexer->current == '#') {
-		token->type = TOK_COMMENT;
-		while (lexer->current != '\0' && lexer->current != '\n') {
-			arrpush(word, lexer->current);
-			ReadChar(lexer);
-		}
-		arrpush(word, '\0');
+		token.type = TOK_COMMENT;
+		Advance(lexer, scanner->until(lexer->input + lexer->position, Remaining(lexer), '\n'));
 	} else if (isalpha(lexer->current)) {
-		do {
-			arrpush(word, lexer->current);
-			ReadChar(lexer);
-		} while (isalnum(lexer->current));
-		arrpush(word, '\0');
-
-		token->type = GetTokenType(word);
-		token->type = token->type ? token->type : TOK_IDENTIFIER;
-	} else if (isdigit(lexer->current)) {
-		token->type = TOK_INTEGER;
+		Advance(lexer, scanner->word(lexer->input + lexer->position, Remaining(lexer)));
+
+		token.length = lexer->position - token.offset;
+		token.type   = GetWordType(lexer->input + token.offset, token.length);
 
-		do {
-			arrpush(word, lexer->current);
-			ReadChar(lexer);
-		} while (isdigit(lexer->current));
-		arrpush(word, '\0');
+		if (token.type == TOK_IDENTIFIER)
+			token.symbol = Intern(lexer->symbols, lexer->input + token.offset, token.length);
+	} else if (isdigit(lexer->current)) {
+		token.type = TOK_INTEGER;
+		Advance(lexer, scanner->digits(lexer->input + lexer->position, Remaining(lexer)));
 	} else if (lexer->current == '"') {
-		token->type = TOK_STRING;
+		token.type = TOK_STRING;
 
 		ReadChar(lexer);
-		while (lexer->current != '"') {
-			if (lexer->current == '\0') {
-				token->type = TOK_EOF;
-				while (arrlen(word)) arrpop(word);
-				arrpush(word, 'E');
-				arrpush(word, 'O');
-				arrpush(word, 'F');
-				arrpush(word, '\0');
-				fprintf(stderr, "Unterminated string at line %d\n", lexer->row);
-				break;
-			}
-
-			arrpush(word, lexer->current);
-			ReadChar(lexer);
+		token.offset++;
+
+		Advance(lexer, scanner->until(lexer->input + lexer->position, Remaining(lexer), '"'));
+		if (lexer->current == '\0') {
+			token.type = TOK_EOF;
+			lexer->errors++;
+			if (!lexer->speculative)
+				fprintf(stderr, "Unterminated string at line %d\n", Line(lexer, token.offset));
 		}
 
-		arrpush(word, '\0');
-
+		token.length = lexer->position - token.offset;
 		ReadChar(lexer);
+		return token;
 	} else {
-		arrpush(word, lexer->current);
-		arrpush(word, lexer->peek);
-		arrpush(word, '\0');
+		token.type = GetOperatorType(lexer->current, lexer->peek);
+
+		switch (token.type) {
+		case TOK_EQUAL:
+		case TOK_UNEQUAL:
+		case TOK_LESSER_EQ:
+		case TOK_GREATER_EQ: ReadChar(lexer); break;
+		case TOK_EOF:
+			lexer->errors++;
+			if (lexer->speculative) break;
+			fprintf(stderr, "Unexpected character '%c' (0x%X) at line %d\n",
+			        lexer->current, lexer->current, Line(lexer, token.offset));
+			break;
+		default: break;
+		}
+
+		ReadChar(lexer);
+	}
+
+	token.length = lexer->position - token.offset;
+	return token;
+}
+
+static void
+Seek(Lexer *lexer, int position)
+{
+	Advance(lexer, position - lexer->position);
+}
+
+static void
+Push(TokenList *tokens, Token token)
+{
+	arrpush(tokens->types, token.type);
+	arrpush(tokens->offsets, token.offset);
+	arrpush(tokens->lengths, token.length);
+	arrpush(tokens->symbols, token.symbol);
+}
+
+static void
+Reserve(TokenList *tokens, int count)
+{
+	arrsetcap(tokens->types, count);
+	arrsetcap(tokens->offsets, count);
+	arrsetcap(tokens->lengths, count);
+	arrsetcap(tokens->symbols, count);
+}
 
-		token->type = GetTokenType(word);
+static int
+Ended(TokenList *tokens)
+{
+	return arrlen(tokens->types) && arrlast(tokens->types) == TOK_EOF;
+}
 
-		arrpop(word);
-		arrpop(word);
-		arrpush(word, '\0');
+/* Appends the tokens starting before `end` to the lexer's list, dropping
+ * comments. Returns where the last of them ended */
+static int
+LexRange(Lexer *lexer, int end)
+{
+	int   stop = lexer->position;
+	Token token;
 
-		if (token->type) ReadChar(lexer);
-		else {
-			token->type = GetTokenType(word);
+	do {
+		token = NextToken(lexer);
+		if (token.offset >= end) break;
 
-			if (token->type == TOK_EOF && lexer->current) {
-				fprintf(stderr, "Unexpected character '%c' (0x%X) at line %d\n",
-				        lexer->current, lexer->current, lexer->row);
-			}
+		if (token.type != TOK_COMMENT) Push(lexer->tokens, token);
+		stop = lexer->position;
+	} while (token.type != TOK_EOF);
+
+	return stop;
+}
+
+/* Large inputs are split at line starts and every chunk is lexed on its own
+ * thread as if nothing was open where it begins. A chunk is only right about
+ * that when the previous one stopped before its start; otherwise it began
+ * inside a string and is lexed again, until the tokens fall back in step
+ * with what the thread found */
+#define LEX_PARALLEL_MIN (1 << 20)
+#define LEX_CHUNK_MIN    (1 << 18)
+#define LEX_MAX_THREADS  16
+
+typedef struct {
+	Lexer    *lexer; /* speculative, with an arena and symbols of its own */
+	int       start;
+	int       end;  /* tokens starting here or later belong to the next chunk */
+	int       stop; /* end of the last token */
+	pthread_t thread;
+} Chunk;
+
+static void *
+LexChunk(void *argument)
+{
+	Chunk *chunk = argument;
+
+	SetArrayArena(chunk->lexer->arena);
+	Reserve(chunk->lexer->tokens, (chunk->end - chunk->start) / 4 + 16);
+	chunk->stop = LexRange(chunk->lexer, chunk->end);
+
+	return NULL;
+}
+
+/* Moves the chunk's tokens from `first` on into the lexer's list, exchanging
+ * the chunk's symbol ids for the lexer's */
+static void
+Splice(Lexer *lexer, Chunk *chunk, int first)
+{
+	TokenList   *tokens  = chunk->lexer->tokens;
+	SymbolTable *symbols = chunk->lexer->symbols;
+	int          count   = arrlen(tokens->types);
+	int         *remap   = ArenaAlloc(chunk->lexer->arena, arrlen(symbols->names) * sizeof(int));
+	int          i, symbol;
+	Token        token;
+
+	memset(remap, -1, arrlen(symbols->names) * sizeof(int));
+
+	for (i = first; i < count; i++) {
+		token = (Token){.type   = tokens->types[i],
+		                .offset = tokens->offsets[i],
+		                .length = tokens->lengths[i],
+		                .symbol = tokens->symbols[i]};
+
+		if ((symbol = token.symbol) >= 0) {
+			if (remap[symbol] < 0)
+				remap[symbol] = Intern(lexer->symbols, SymbolName(symbols, symbol),
+				                       strlen(SymbolName(symbols, symbol)));
+			token.symbol = remap[symbol];
 		}
+		Push(lexer->tokens, token);
+	}
+}
 
-		ReadChar(lexer);
+/* Lexes the chunk for real from `stop`. Returns where its last token ended */
+static int
+Relex(Lexer *lexer, Chunk *chunk, int stop)
+{
+	TokenList *guess = chunk->lexer->tokens;
+	int        count = arrlen(guess->types);
+	int        i     = 0;
+	Token      token;
+
+	Seek(lexer, stop);
+	do {
+		token = NextToken(lexer);
+		if (token.offset >= chunk->end) break;
+
+		/* a token both lexers agree on starts from the same state, so
+		 * everything after it is the same too. Chunks with errors are lexed
+		 * to the end to report them */
+		while (i < count && guess->offsets[i] < token.offset) i++;
+		if (!chunk->lexer->errors && i < count && guess->offsets[i] == token.offset &&
+		    guess->types[i] == token.type && guess->lengths[i] == token.length) {
+			Splice(lexer, chunk, i);
+			return chunk->stop;
+		}
+
+		if (token.type != TOK_COMMENT) Push(lexer->tokens, token);
+		stop = lexer->position;
+	} while (token.type != TOK_EOF);
+
+	return stop;
+}
+
+static void
+TokenizeChunks(Lexer *lexer, int count)
+{
+	Chunk        chunks[LEX_MAX_THREADS];
+	MemoryBlock *arena;
+	int          i, start, end, stop, total;
+
+	for (i = 0, start = 0; i < count; i++, start = end) {
+		end = (long)lexer->length * (i + 1) / count;
+		if (end < start) end = start;
+		end += lexer->scanner->until(lexer->input + end, lexer->length - end, '\n');
+		end = i == count - 1 ? lexer->length + 1 : end + (end < lexer->length);
+
+		/* only address space, a chunk has no more tokens than bytes */
+		arena = CreateArena((long)(end - start) * 32 + ARENA_HUGE_PAGE, lexer->arena->flags);
+
+		chunks[i] = (Chunk){.start = start, .end = end};
+		chunks[i].lexer =
+			CreateLexer(arena, CreateSymbolTable(arena), lexer->input, lexer->length);
+		chunks[i].lexer->speculative = 1;
+		Seek(chunks[i].lexer, start);
+
+		pthread_create(&chunks[i].thread, NULL, LexChunk, &chunks[i]);
+	}
+
+	for (i = 0, total = 0; i < count; i++) {
+		pthread_join(chunks[i].thread, NULL);
+		total += arrlen(chunks[i].lexer->tokens->types);
 	}
+	Reserve(lexer->tokens, total + 16);
 
-	token->value = ArenaAlloc(lexer->arena, arrlen(word));
-	strncpy(token->value, word, arrlen(word));
-	arrfree(word);
+	for (i = 0, stop = 0; i < count && !Ended(lexer->tokens); i++) {
+		if (stop <= chunks[i].start && !chunks[i].lexer->errors) {
+			Splice(lexer, &chunks[i], 0);
+			stop = chunks[i].stop;
+		} else stop = Relex(lexer, &chunks[i], stop);
+	}
 
-	return token;
+	for (i = 0; i < count; i++) DestroyArena(chunks[i].lexer->arena);
+}
+
+/* Lexes the rest of the input into the lexer's token list. Comments are
+ * dropped, the list always ends with a TOK_EOF; lexing more input replaces
+ * the TOK_EOF of the earlier list */
+TokenList *
+Tokenize(Lexer *lexer)
+{
+	TokenList   *tokens  = lexer->tokens;
+	MemoryBlock *outer   = SetArrayArena(lexer->arena);
+	long         threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (Ended(tokens)) {
+		arrpop(tokens->types);
+		arrpop(tokens->offsets);
+		arrpop(tokens->lengths);
+		arrpop(tokens->symbols);
+	}
+
+	if (threads > LEX_MAX_THREADS) threads = LEX_MAX_THREADS;
+	if (threads > lexer->length / LEX_CHUNK_MIN) threads = lexer->length / LEX_CHUNK_MIN;
+
+	if (lexer->position == 0 && lexer->length >= LEX_PARALLEL_MIN && threads > 1) {
+		TokenizeChunks(lexer, threads);
+	} else {
+		/* one token per four bytes is plenty for typical sources, so the
+		 * arrays rarely have to move */
+		Reserve(tokens, lexer->length / 4 + 16);
+		LexRange(lexer, lexer->length + 1);
+	}
+
+	tokens->count = arrlen(tokens->types);
+
+	SetArrayArena(outer);
+	return tokens;
+}
+
+/* Adds a line to the end of the input, for lexing more of a session. The
+ * lexer continues at the start of the line, whatever was left of the input
+ * before it is skipped. Tokens keep their offsets, which stay valid when the
+ * input moves */
+void
+AppendInput(Lexer *lexer, char *text, int length)
+{
+	MemoryBlock *outer = SetArrayArena(lexer->arena);
+	int          start;
+
+	if (!lexer->buffer && lexer->length) {
+		memcpy(arraddnptr(lexer->buffer, lexer->length), lexer->input, lexer->length);
+	}
+
+	start = lexer->length;
+	if (length) memcpy(arraddnptr(lexer->buffer, length), text, length);
+	arrpush(lexer->buffer, '\n');
+
+	/* terminated, but the zero is not counted so the next line replaces it */
+	arrpush(lexer->buffer, '\0');
+	arrpop(lexer->buffer);
+
+	lexer->input  = lexer->tokens->input = lexer->buffer;
+	lexer->length = arrlen(lexer->buffer);
+	Seek(lexer, start);
+
+	/* let the line index be built again when it is needed */
+	lexer->tokens->lines = NULL;
+
+	SetArrayArena(outer);
+}
+
+/* Finds the row and column of a byte of the input, indexing the line starts
+ * the first time a position is asked for */
+void
+GetPosition(TokenList *tokens, int offset, int *row, int *column)
+{
+	int low, high, middle;
+
+	if (!tokens->lines) {
+		MemoryBlock *outer = SetArrayArena(tokens->arena);
+		char        *line  = tokens->input;
+
+		arrpush(tokens->lines, 0);
+		while ((line = strchr(line, '\n'))) arrpush(tokens->lines, ++line - tokens->input);
+
+		SetArrayArena(outer);
+	}
+
+	low  = 0;
+	high = arrlen(tokens->lines) - 1;
+	while (low < high) {
+		middle = (low + high + 1) / 2;
+		if (tokens->lines[middle] <= offset) low = middle;
+		else high = middle - 1;
+	}
+
+	*row    = low + 1;
+	*column = offset - tokens->lines[low] + 1;
 }
 
+/* Returns a terminated copy of the token's text */
 char *
-TokenString(Token *token)
+TokenValue(MemoryBlock *arena, TokenList *tokens, int index)
+{
+	int   length = tokens->lengths[index];
+	char *value  = ArenaAlloc(arena, length + 1);
+
+	memcpy(value, tokens->input + tokens->offsets[index], length);
+	value[length] = '\0';
+	return value;
+}
+
+char *
+TypeToString(TokenType type)
+{
+	return TokenNames[type];
+}
+
+char *
+TokenString(TokenList *tokens, int index)
 {
 	static char string[64];
-	if (token->type == TOK_STRING) {
-		snprintf(string, sizeof(string), "%s(\"%s\")", TokenNames[token->type], token->value);
+	TokenType   type = tokens->types[index];
+	char       *text = tokens->input + tokens->offsets[index];
+
+	if (type == TOK_STRING) {
+		snprintf(string, sizeof(string), "%s(\"%.*s\")", TokenNames[type],
+		         tokens->lengths[index], text);
 	} else {
-		snprintf(string, sizeof(string), "%s(%s)", TokenNames[token->type], token->value);
+		snprintf(string, sizeof(string), "%s(%.*s)", TokenNames[type],
+		         tokens->lengths[index], text);
 	}
 	return string;
 }
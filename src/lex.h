@@ -2,6 +2,8 @@
 #define lex_h
 
 #include "arena.h"
+#include "scan.h"
+#include "symbol.h"
 
 /* clang-format off */
 typedef enum {
@@ -38,13 +40,30 @@ typedef enum {
 } TokenType;
 /* clang-format on */
 
+/* Tokens are slices of the lexer input, a terminated copy of their text is
+ * only made by TokenValue */
 typedef struct {
 	TokenType type;
-	char     *value;
-	int       row;
-	int       column;
+	int       offset;
+	int       length;
+	int       symbol; /* interned name of identifiers, -1 otherwise */
 } Token;
 
+/* The whole input lexed up front, one array per field. Rows and columns are
+ * not stored, GetPosition derives them from the line index when a
+ * diagnostic needs them */
+typedef struct {
+	char          *input;
+	MemoryBlock   *arena;
+	int            count;
+	unsigned char *types;
+	int           *offsets;
+	int           *lengths;
+	int           *symbols; /* see Token */
+	int           *lines;   /* offsets of line starts, built on first use */
+	SymbolTable   *table;
+} TokenList;
+
 typedef struct {
 	char     *key;
 	TokenType value;
@@ -52,18 +71,27 @@ typedef struct {
 
 typedef struct {
 	char        *input;
+	int          length;
+	Scanner     *scanner;
 	MemoryBlock *arena;
+	SymbolTable *symbols;
+	TokenList   *tokens;
 	char         current;
 	char         peek;
-	int          position;
-	int          row;
-	int          column;
+	int          position;    /* index of current */
+	int          speculative; /* holds diagnostics back */
+	int          errors;
+	char        *buffer; /* copy of the input, made once text is appended */
 } Lexer;
 
-Lexer *CreateLexer(char *);
-void   DestroyLexer(Lexer *);
-Token *NextToken(Lexer *);
+Lexer     *CreateLexer(MemoryBlock *, SymbolTable *, char *, int);
+Token      NextToken(Lexer *);
+TokenList *Tokenize(Lexer *);
+void       AppendInput(Lexer *, char *, int);
 
-char *TokenString(Token *);
+void  GetPosition(TokenList *, int, int *, int *);
+char *TokenValue(MemoryBlock *, TokenList *, int);
+char *TokenString(TokenList *, int);
+char *TypeToString(TokenType);
 
 #endif /* !lex_h */
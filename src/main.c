@@ -1,48 +1,192 @@
+#include <errno.h>
+#include <limits.h>
 #include <readline/readline.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
 
+#include "arena.h"
+
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
 #include "eval.h"
+#include "image.h"
 #include "lex.h"
+#include "optimize.h"
 #include "parse.h"
+#include "resolve.h"
+#include "trace.h"
 #include "utils.h"
 
+/* One reservation per run, split between the stages so that each of them
+ * can be reset on its own */
+typedef struct {
+	MemoryBlock *arena;
+	MemoryBlock *lexer;
+	MemoryBlock *parser;
+	MemoryBlock *evaluator;
+	MemoryBlock *scratch;
+	MemoryBlock *symbols;
+} Session;
+
+Session CreateSession(long);
+void    DestroySession(Session *);
+
 void LaunchREPL();
 void RunFile(char *, char **);
 
+static int   mem_stats;
+static int   lazy_procs;
+static char *cache; /* directory of program images */
+static int   arena_flags;
+static long  arena_size = ARENA_SIZE;
+
 int
 main(int argc, char **argv)
 {
-	if (argc > 1) RunFile(argv[1], argv + 1);
+	char *end;
+	int   i;
+
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--mem-stats") == 0) mem_stats = 1;
+		else if (strcmp(argv[i], "--lazy-procs") == 0) lazy_procs = 1;
+		else if (strcmp(argv[i], "--huge-pages") == 0) arena_flags |= ARENA_HUGE_PAGES;
+		else if (strcmp(argv[i], "--prefault") == 0) arena_flags |= ARENA_PREFAULT;
+		else if (strncmp(argv[i], "--arena-size=", 13) == 0) {
+			/* in MiB, every stage needs at least one huge page */
+			errno     = 0;
+			long size = strtol(argv[i] + 13, &end, 10);
+			if (end == argv[i] + 13 || *end || errno == ERANGE || size < 5 * ARENA_HUGE_PAGE >> 20 ||
+			    size > ARENA_MAX_SIZE >> 20) {
+				fprintf(stderr, "Arena size has to be between %ld and %ld MiB\n",
+				        5 * ARENA_HUGE_PAGE >> 20, ARENA_MAX_SIZE >> 20);
+				return EX_USAGE;
+			}
+			arena_size = size << 20;
+		} else if (strncmp(argv[i], "--inline-budget=", 16) == 0) {
+			/* in nodes, 0 turns inlining off */
+			errno       = 0;
+			long budget = strtol(argv[i] + 16, &end, 10);
+			if (end == argv[i] + 16 || *end || errno == ERANGE || budget < 0 || budget > INT_MAX) {
+				fprintf(stderr, "Inline budget has to be a number of nodes, 0 to turn it off\n");
+				return EX_USAGE;
+			}
+			inline_budget = budget;
+		} else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			cache = argv[i] + 8;
+		} else if (strncmp(argv[i], "--trace=", 8) == 0) {
+			if (SetTrace(argv[i] + 8) < 0) {
+				fprintf(stderr, "Unknown trace \"%s\", expected e.g. lex,parse:2,eval,call\n",
+				        argv[i] + 8);
+				return EX_USAGE;
+			}
+		} else {
+			fprintf(stderr, "Unknown option \"%s\"\n", argv[i]);
+			return EX_USAGE;
+		}
+	}
+
+	if (i < argc) RunFile(argv[i], argv + i);
 	else LaunchREPL();
 }
 
+/* Address space a stage may need per byte of source. Growing arrays leave
+ * their old copies behind, and a token can be as short as a byte */
+#define LEXER_PER_BYTE     32 /* token list, per thread and merged */
+#define PARSER_PER_BYTE    32 /* pools of the tree */
+#define EVALUATOR_PER_BYTE 16 /* globals, a slot per name */
+#define SCRATCH_PER_BYTE   32 /* parser stack, pools copied by Optimize */
+#define SYMBOLS_PER_BYTE   4  /* names and their table */
+
+/* The larger of the stage's share of --arena-size and what `needed` rounds
+ * up to. Only what is used gets committed, so reserving more is cheap */
+static long
+StageSize(long share, long needed)
+{
+	needed = (needed + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+	return needed > share ? needed : share;
+}
+
+/* Sized for `input` bytes of source, 0 when it is not known up front */
+Session
+CreateSession(long input)
+{
+	long    share     = arena_size / 5 & ~(ARENA_HUGE_PAGE - 1);
+	long    lexer     = StageSize(share, input * LEXER_PER_BYTE);
+	long    parser    = StageSize(share, input * PARSER_PER_BYTE);
+	long    scratch   = StageSize(share, input * SCRATCH_PER_BYTE);
+	long    symbols   = StageSize(share, input * SYMBOLS_PER_BYTE);
+	long    evaluator = StageSize(share, input * EVALUATOR_PER_BYTE);
+	Session session   = {.arena = CreateArena(lexer + parser + evaluator + scratch + symbols,
+	                                          arena_flags)};
+
+	session.lexer     = CreateSubArena(session.arena, lexer);
+	session.parser    = CreateSubArena(session.arena, parser);
+	session.evaluator = CreateSubArena(session.arena, evaluator);
+	session.scratch   = CreateSubArena(session.arena, scratch);
+	session.symbols   = CreateSubArena(session.arena, symbols);
+
+	return session;
+}
+
+void
+DestroySession(Session *session)
+{
+	if (mem_stats) {
+		PrintArenaStatsHeader();
+		PrintArenaStats("lexer", session->lexer);
+		PrintArenaStats("parser", session->parser);
+		PrintArenaStats("evaluator", session->evaluator);
+		PrintArenaStats("scratch", session->scratch);
+		PrintArenaStats("symbols", session->symbols);
+	}
+
+	DestroyArena(session->lexer);
+	DestroyArena(session->parser);
+	DestroyArena(session->evaluator);
+	DestroyArena(session->scratch);
+	DestroyArena(session->symbols);
+	DestroyArena(session->arena);
+}
+
+/* Every line is lexed, parsed and evaluated into the same session, so what
+ * one line defines is there for the next */
 void
 LaunchREPL()
 {
-	char *line;
+	char   *line;
+	Session session = CreateSession(0);
+
+	SymbolTable *symbols = CreateSymbolTable(session.symbols);
+	Lexer       *lexer   = CreateLexer(session.lexer, symbols, "", 0);
+	Parser      *parser  = CreateParser(session.parser, session.scratch, lexer);
+	parser->lazy         = lazy_procs;
+
+	Evaluator *evaluator = CreateEvaluator(session.evaluator, session.scratch, parser->ast);
 
 	for (;;) {
 		line = readline("> ");
 		if (!line) break;
 
-		Lexer  *lexer  = CreateLexer(line);
-		Parser *parser = CreateParser(lexer);
-
-		Statement *program = Parse(parser);
-		Evaluator *evaluator = CreateEvaluator(program);
-
-		Eval(evaluator, program);
+		AppendInput(lexer, line, strlen(line));
+		ContinueParser(parser);
+		free(line);
 
-		DestroyEvaluator(evaluator);
-		DestroyParser(parser);
-		DestroyLexer(lexer);
+		/* later lines can bind any name again, a line is not the program */
+		Parse(parser);
+		Optimize(parser->ast, parser->ast->program, false);
+		Resolve(parser->ast, parser->ast->program, false);
+		Eval(evaluator, parser->ast->program);
 
-		free(line);
+		if (evaluator->result.type == VAL_INTEGER) printf("%d\n", evaluator->result.integer);
+		else if (evaluator->result.type == VAL_STRING) printf("%s\n", evaluator->result.string);
+		evaluator->result = (Value){.type = VAL_NONE};
 	}
+
+	DestroyEvaluator(evaluator);
+	DestroySession(&session);
 }
 
 void
@@ -50,26 +194,55 @@ RunFile(char *script, char **argv)
 {
 	FILE *file;
 	char *buf;
+	long  size;
+	int   mapped;
+
+	/* "-" and anything that cannot be mapped is read as a stream */
+	buf    = strcmp(script, "-") != 0 ? MapFile(script, &size) : NULL;
+	mapped = buf != NULL;
+	if (!mapped) {
+		file = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if (!file) {
+			fprintf(stderr, "File \"%s\" does not exits\n", script);
+			return;
+		}
+
+		buf = ReadFile(file, &size);
+	}
 
-	file = fopen(script, "r");
-	if (!file) {
-		fprintf(stderr, "File \"%s\" does not exits\n", script);
-		return;
+	Session       session = CreateSession(size);
+	SymbolTable  *symbols = CreateSymbolTable(session.symbols);
+	Ast          *ast     = NULL;
+	char         *image   = NULL;
+	unsigned long hash    = 0;
+
+	/* an image of the same source replaces lexing and parsing */
+	if (cache) {
+		hash  = HashSource(buf, size, inline_budget); /* inlining changes the tree */
+		image = ImagePath(session.parser, cache, hash);
+		ast   = LoadImage(session.parser, symbols, image, hash, size);
 	}
 
-	buf = ReadFile(file);
+	if (!ast) {
+		Lexer  *lexer  = CreateLexer(session.lexer, symbols, buf, size);
+		Parser *parser = CreateParser(session.parser, session.scratch, lexer);
+		parser->lazy   = lazy_procs;
 
-	Lexer  *lexer  = CreateLexer(buf);
-	Parser *parser = CreateParser(lexer);
+		ast = Parse(parser);
+		Optimize(ast, ast->program, true);
+		Resolve(ast, ast->program, true);
+		if (image) SaveImage(ast, image, hash, size);
+	}
 
-	Statement *program = Parse(parser);
-	Evaluator *evaluator = CreateEvaluator(program);
+	Evaluator *evaluator = CreateEvaluator(session.evaluator, session.scratch, ast);
 
-	Eval(evaluator, program);
+	Eval(evaluator, ast->program);
+	PrintVariable(evaluator, "z");
 
 	DestroyEvaluator(evaluator);
-	DestroyParser(parser);
-	DestroyLexer(lexer);
+	if (ast->image) UnloadImage(ast);
+	DestroySession(&session);
 
-	free(buf);
+	if (mapped) UnmapFile(buf, size);
+	else free(buf);
 }
@@ -0,0 +1,970 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "optimize.h"
+#include "resolve.h"
+#include "stb_ds.h"
+#include "trace.h"
+
+/* Replaces the node at `index`, the nodes it no longer refers to are left
+ * unused in the pool */
+static void
+Rewrite(Ast *ast, int index, Expression expression, char *kind)
+{
+	int row, column;
+
+	if (TRACING(TRACE_OPT, TRACE_BRIEF)) {
+		GetPosition(ast->tokens, ast->tokens->offsets[ast->expressions[index].token], &row,
+		            &column);
+		TRACE(TRACE_OPT, TRACE_BRIEF, "%s at line %d\n", kind, row);
+	}
+	ast->expressions[index] = expression;
+}
+
+static int
+NewConstant(Ast *ast, int integer)
+{
+	return PoolConstant(ast, &ast->pool.integers, integer,
+	                    (Value){.type = VAL_INTEGER, .integer = integer});
+}
+
+/* A literal standing in for the node at `index` */
+static Expression
+Folded(Ast *ast, int index, int integer)
+{
+	return (Expression){.type             = EXPR_LITERAL,
+	                    .token            = ast->expressions[index].token,
+	                    .literal.constant = NewConstant(ast, integer)};
+}
+
+/* Returns non-zero if the node is an integer literal and stores its value */
+static int
+IsConstant(Ast *ast, int index, int *integer)
+{
+	Expression *expression = &ast->expressions[index];
+	Value      *value;
+
+	if (expression->type != EXPR_LITERAL) return 0;
+	value = &ast->constants[expression->literal.constant];
+	if (value->type != VAL_INTEGER) return 0;
+
+	*integer = value->integer;
+	return 1;
+}
+
+/* Whether the node evaluates to an integer whatever it refers to. Names and
+ * calls can hold anything, operators always give integers */
+static int
+IsInteger(Ast *ast, int index)
+{
+	int integer;
+
+	switch (ast->expressions[index].type) {
+	case EXPR_LITERAL: return IsConstant(ast, index, &integer);
+	case EXPR_INFIX:
+	case EXPR_PREFIX: return 1;
+	default: return 0;
+	}
+}
+
+/* Whether the node can stand in for an operation that gives it back
+ * unchanged. A name keeps the type of what it holds */
+static int
+IsOperand(Ast *ast, int index)
+{
+	return ast->expressions[index].type == EXPR_IDENTIFIER || IsInteger(ast, index);
+}
+
+/* Whether the node can be dropped without being evaluated. Calls have
+ * effects, and so does a division that may trap. Reading a name that is
+ * not bound exits, so names only count with `names` set, where they are
+ * known to be read anyway */
+static int
+IsPure(Ast *ast, int index, int names)
+{
+	Expression *expression = &ast->expressions[index];
+	int         divisor;
+
+	switch (expression->type) {
+	case EXPR_IDENTIFIER: return names;
+	case EXPR_LITERAL: return 1;
+	case EXPR_PREFIX: return IsPure(ast, expression->prefix.value, names);
+	case EXPR_INFIX:
+		if (expression->operator == TOK_SLASH &&
+		    !(IsConstant(ast, expression->infix.value2, &divisor) && divisor != 0 &&
+		      divisor != -1))
+			return 0;
+		return IsPure(ast, expression->infix.value1, names) &&
+		       IsPure(ast, expression->infix.value2, names);
+	default: return 0;
+	}
+}
+
+/* Returns k if `integer` is 2^k with k > 0, otherwise 0 */
+static int
+Log2(int integer)
+{
+	int k;
+
+	if (integer < 2 || (integer & (integer - 1))) return 0;
+	for (k = 0; integer > 1; k++) integer >>= 1;
+	return k;
+}
+
+/* Folds x op y for the operators EvalExpression knows, wrapping around like
+ * it does. Returns 0 where the result is left to the evaluator */
+static int
+FoldInfix(int operator, int x, int y, int *result)
+{
+	switch (operator) {
+	case TOK_PLUS: *result = (int)((unsigned)x + (unsigned)y); return 1;
+	case TOK_MINUS: *result = (int)((unsigned)x - (unsigned)y); return 1;
+	case TOK_STAR: *result = (int)((unsigned)x * (unsigned)y); return 1;
+	case TOK_SLASH:
+		if (y == 0 || (x == INT_MIN && y == -1)) return 0;
+		*result = x / y;
+		return 1;
+	default: return 0;
+	}
+}
+
+static void
+SimplifyInfix(Ast *ast, int index)
+{
+	Expression expression = ast->expressions[index];
+	int        value1     = expression.infix.value1;
+	int        value2     = expression.infix.value2;
+	int        x, y, k, result;
+	int        constant1  = IsConstant(ast, value1, &x);
+	int        constant2  = IsConstant(ast, value2, &y);
+
+	if (constant1 && constant2) {
+		if (FoldInfix(expression.operator, x, y, &result))
+			Rewrite(ast, index, Folded(ast, index, result), "constant");
+		return;
+	}
+
+	/* an operand standing in for the whole expression has to give an
+	 * integer as well, a dropped one must not have effects */
+	switch (expression.operator) {
+	case TOK_PLUS:
+		if (constant2 && y == 0 && IsOperand(ast, value1))
+			Rewrite(ast, index, ast->expressions[value1], "x + 0");
+		else if (constant1 && x == 0 && IsOperand(ast, value2))
+			Rewrite(ast, index, ast->expressions[value2], "0 + x");
+		break;
+	case TOK_MINUS:
+		if (constant2 && y == 0 && IsOperand(ast, value1))
+			Rewrite(ast, index, ast->expressions[value1], "x - 0");
+		break;
+	case TOK_SLASH:
+		if (constant2 && y == 1 && IsInteger(ast, value1))
+			Rewrite(ast, index, ast->expressions[value1], "x / 1");
+		break;
+	case TOK_STAR:
+		if (constant1 && !constant2) {
+			/* constants go to the right */
+			expression.infix.value1 = value2;
+			expression.infix.value2 = value1;
+			value1                  = value2;
+			value2                  = expression.infix.value2;
+			y                       = x;
+		} else if (!constant2) break;
+
+		if (y == 1 && IsOperand(ast, value1)) {
+			Rewrite(ast, index, ast->expressions[value1], "x * 1");
+		} else if (y == 0 && IsPure(ast, value1, 0)) {
+			Rewrite(ast, index, Folded(ast, index, 0), "x * 0");
+		} else if ((k = Log2(y))) {
+			/* the operand is read as an integer either way */
+			ast->expressions[value2].literal.constant = NewConstant(ast, k);
+			expression.operator = OP_SHIFT_LEFT;
+			Rewrite(ast, index, expression, "x * 2^k");
+		}
+		break;
+	default: break;
+	}
+}
+
+static void
+SimplifyPrefix(Ast *ast, int index)
+{
+	Expression expression = ast->expressions[index];
+	int        x;
+
+	if (!IsConstant(ast, expression.prefix.value, &x)) return;
+
+	switch (expression.operator) {
+	case TOK_MINUS: Rewrite(ast, index, Folded(ast, index, (int)-(unsigned)x), "constant"); break;
+	case TOK_NOT: Rewrite(ast, index, Folded(ast, index, !x), "constant"); break;
+	default: break;
+	}
+}
+
+/* Common subexpressions of a statement are computed once, where they are
+ * first evaluated, and read back from a slot of the call afterwards */
+typedef struct {
+	int      index;
+	int      order; /* in which the trees are evaluated */
+	int      size;  /* nodes */
+	unsigned hash;
+} Candidate;
+
+/* Whether two call-free trees compute the same value */
+static int
+Same(Ast *ast, int a, int b)
+{
+	Expression *x = &ast->expressions[a];
+	Expression *y = &ast->expressions[b];
+	Value      *c, *d;
+
+	if (x->type != y->type || x->operator != y->operator) return 0;
+
+	switch (x->type) {
+	case EXPR_IDENTIFIER:
+		/* a name copied in by inlining is a global, whatever is bound here */
+		return x->identifier.symbol == y->identifier.symbol &&
+		       x->identifier.depth == y->identifier.depth;
+	case EXPR_LITERAL:
+		c = &ast->constants[x->literal.constant];
+		d = &ast->constants[y->literal.constant];
+		/* strings are interned, equal ones share their pointer */
+		return c->type == d->type &&
+		       (c->type == VAL_STRING ? c->string == d->string : c->integer == d->integer);
+	case EXPR_PREFIX: return Same(ast, x->prefix.value, y->prefix.value);
+	case EXPR_INFIX:
+		return Same(ast, x->infix.value1, y->infix.value1) &&
+		       Same(ast, x->infix.value2, y->infix.value2);
+	default: return 0;
+	}
+}
+
+/* Mixes a value into a structural hash, FNV style */
+static unsigned
+Mix(unsigned hash, unsigned value)
+{
+	return (hash ^ value) * 16777619u;
+}
+
+/* Adds the operators of the tree that contain no calls to `candidates` in
+ * evaluation order, returns non-zero if the whole tree is call-free. Calls
+ * and shared trees are searched but are not candidates themselves */
+static int
+Collect(Ast *ast, int index, Candidate **candidates, Candidate *candidate)
+{
+	Expression expression = ast->expressions[index];
+	Value      constant;
+	Candidate  value1, value2;
+	int        pure, i;
+
+	*candidate = (Candidate){.index = index,
+	                         .size  = 1,
+	                         .hash  = Mix(2166136261u, expression.type << 8 | expression.operator)};
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER:
+		candidate->hash = Mix(candidate->hash, expression.identifier.symbol);
+		return 1;
+	case EXPR_LITERAL:
+		constant        = ast->constants[expression.literal.constant];
+		candidate->hash = Mix(candidate->hash, constant.type == VAL_STRING
+		                                           ? (unsigned)(long)constant.string
+		                                           : (unsigned)constant.integer);
+		return 1;
+	case EXPR_PREFIX:
+		pure             = Collect(ast, expression.prefix.value, candidates, &value1);
+		candidate->size += value1.size;
+		candidate->hash  = Mix(candidate->hash, value1.hash);
+		break;
+	case EXPR_INFIX:
+		pure             = Collect(ast, expression.infix.value1, candidates, &value1);
+		pure            &= Collect(ast, expression.infix.value2, candidates, &value2);
+		candidate->size += value1.size + value2.size;
+		candidate->hash  = Mix(Mix(candidate->hash, value1.hash), value2.hash);
+		break;
+	case EXPR_CALL:
+		/* arguments are evaluated in the frame of the caller */
+		for (i = 0; i < expression.arity; i++)
+			Collect(ast, ast->lists[expression.call.arguments + i], candidates, &value1);
+		return 0;
+	case EXPR_SHARED:
+		if (expression.shared.value >= 0)
+			Collect(ast, expression.shared.value, candidates, &value1);
+		return 0;
+	default: return 0;
+	}
+
+	candidate->order = arrlen(*candidates);
+	if (pure) arrpush(*candidates, *candidate);
+	return pure;
+}
+
+/* Largest first, equal trees next to each other in evaluation order */
+static int
+CompareCandidates(const void *a, const void *b)
+{
+	const Candidate *x = a, *y = b;
+
+	if (x->size != y->size) return y->size - x->size;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return x->order - y->order;
+}
+
+/* Shares the largest tree that occurs more than once in the expression at
+ * `index`, returns 0 if there is none. The first occurrence of a tree that
+ * is part of larger ones is evaluated with them, so taking the largest
+ * first leaves every tree evaluated before it is read */
+static int
+ShareOne(Ast *ast, int index, int slot, Candidate **candidates)
+{
+	Candidate *c;
+	Candidate  root;
+	Expression first;
+	int        count, i, j;
+
+	arrsetlen(*candidates, 0);
+	Collect(ast, index, candidates, &root);
+
+	c     = *candidates;
+	count = arrlen(c);
+	if (count < 2) return 0;
+	qsort(c, count, sizeof(Candidate), CompareCandidates);
+
+	for (i = 0; i < count; i++) {
+		for (j = i + 1; j < count && c[j].size == c[i].size && c[j].hash == c[i].hash; j++) {
+			if (Same(ast, c[i].index, c[j].index)) goto found;
+		}
+	}
+	return 0;
+
+found:
+	/* the first occurrence is rewritten last, the others are compared with it */
+	for (j = count - 1; j > i; j--) {
+		if (c[j].size != c[i].size || c[j].hash != c[i].hash) continue;
+		if (!Same(ast, c[i].index, c[j].index)) continue;
+
+		Rewrite(ast, c[j].index,
+		        (Expression){.type   = EXPR_SHARED,
+		                     .token  = ast->expressions[c[j].index].token,
+		                     .shared = {slot, -1}},
+		        "common subexpression");
+	}
+
+	first = ast->expressions[c[i].index];
+	arrpush(ast->expressions, first);
+	ast->expressions[c[i].index] = (Expression){.type   = EXPR_SHARED,
+	                                            .token  = first.token,
+	                                            .shared = {slot, arrlen(ast->expressions) - 1}};
+	return 1;
+}
+
+/* Small procs are inlined where it is known which proc a call reaches: the
+ * proc is defined at the top level before the statement making the call
+ * and its name is not bound anywhere else. Only bodies returning a call-free
+ * expression are inlined, and only with pure arguments, so nothing is
+ * evaluated more often than it could be skipped */
+int inline_budget = INLINE_BUDGET;
+
+typedef struct {
+	Ast       *ast;
+	Candidate *candidates;
+	int       *procs; /* symbol -> top-level statement of the proc, or -1 */
+	int        top;   /* top-level statement being optimized */
+} Optimizer;
+
+/* Counts the bindings of every name, returns 0 if a body was skipped */
+static int
+CountBindings(Ast *ast, int block, int *counts)
+{
+	BlockStatement body = ast->blocks[block];
+	Statement      statement;
+	int            i, j;
+
+	if (body.first < 0) return 0;
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		statement = ast->statements[i];
+
+		switch (statement.type) {
+		case STAT_LET: counts[statement.let.identifier]++; break;
+		case STAT_PROC:
+			counts[statement.proc.identifier]++;
+			for (j = 0; j < statement.arity; j++) counts[ast->lists[statement.proc.arguments + j]]++;
+			if (!CountBindings(ast, statement.proc.body, counts)) return 0;
+			break;
+		default: break;
+		}
+	}
+	return 1;
+}
+
+static void
+FindProcs(Optimizer *optimizer)
+{
+	Ast           *ast     = optimizer->ast;
+	BlockStatement program = ast->blocks[ast->program];
+	int            symbols = arrlen(ast->symbols->names);
+	int           *counts  = NULL;
+	Statement      statement;
+	int            i;
+
+	arrsetlen(counts, symbols);
+	for (i = 0; i < symbols; i++) counts[i] = 0;
+	if (!CountBindings(ast, ast->program, counts)) return;
+
+	arrsetlen(optimizer->procs, symbols);
+	for (i = 0; i < symbols; i++) optimizer->procs[i] = -1;
+
+	for (i = program.first; i < program.first + program.count; i++) {
+		statement = ast->statements[i];
+		if (statement.type == STAT_PROC && counts[statement.proc.identifier] == 1)
+			optimizer->procs[statement.proc.identifier] = i;
+	}
+}
+
+/* Nodes in the tree, or -1 if it makes a call */
+static int
+CallFreeSize(Ast *ast, int index)
+{
+	Expression expression = ast->expressions[index];
+	int        size1, size2;
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER:
+	case EXPR_LITERAL: return 1;
+	case EXPR_PREFIX:
+		size1 = CallFreeSize(ast, expression.prefix.value);
+		return size1 < 0 ? -1 : size1 + 1;
+	case EXPR_INFIX:
+		size1 = CallFreeSize(ast, expression.infix.value1);
+		size2 = CallFreeSize(ast, expression.infix.value2);
+		return size1 < 0 || size2 < 0 ? -1 : size1 + size2 + 1;
+	default: return -1;
+	}
+}
+
+/* Reads of the parameter `symbol` in a call-free tree. Names an earlier
+ * inlining made global are not parameters */
+static int
+CountUses(Ast *ast, int index, int symbol)
+{
+	Expression expression = ast->expressions[index];
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER:
+		return expression.identifier.symbol == symbol &&
+		       expression.identifier.depth == SCOPE_UNRESOLVED;
+	case EXPR_PREFIX: return CountUses(ast, expression.prefix.value, symbol);
+	case EXPR_INFIX:
+		return CountUses(ast, expression.infix.value1, symbol) +
+		       CountUses(ast, expression.infix.value2, symbol);
+	default: return 0;
+	}
+}
+
+/* Copies a call-free tree, replacing the parameters with copies of the
+ * arguments. The last of equally named parameters is the one bound, the
+ * other names in a top-level proc are globals, and stay so when the tree
+ * is inlined again. Arguments are copied with `parameters` at -1, their
+ * names are bound where the call is */
+static int
+Substitute(Ast *ast, int index, int parameters, int arguments, int arity)
+{
+	Expression expression = ast->expressions[index];
+	int        i;
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER:
+		if (expression.identifier.depth != SCOPE_UNRESOLVED) break;
+		for (i = arity - 1; i >= 0; i--) {
+			if (ast->lists[parameters + i] == expression.identifier.symbol)
+				return Substitute(ast, ast->lists[arguments + i], -1, 0, 0);
+		}
+		if (parameters >= 0) expression.identifier.depth = SCOPE_GLOBAL;
+		break;
+	case EXPR_PREFIX:
+		expression.prefix.value = Substitute(ast, expression.prefix.value, parameters, arguments, arity);
+		break;
+	case EXPR_INFIX:
+		expression.infix.value1 = Substitute(ast, expression.infix.value1, parameters, arguments, arity);
+		expression.infix.value2 = Substitute(ast, expression.infix.value2, parameters, arguments, arity);
+		break;
+	default: break;
+	}
+
+	arrpush(ast->expressions, expression);
+	return arrlen(ast->expressions) - 1;
+}
+
+/* Replaces the call at `index` with the expression its proc returns,
+ * returns 0 if it can not be inlined. The budget counts every use of a
+ * parameter at the size of its argument */
+static int
+Inline(Optimizer *optimizer, int index)
+{
+	Ast           *ast  = optimizer->ast;
+	Expression     call = ast->expressions[index];
+	Statement      proc;
+	BlockStatement body;
+	int            statement, value, size, argument, uses, i, j;
+
+	if (!optimizer->procs ||
+	    (statement = optimizer->procs[ast->expressions[call.call.callee].identifier.symbol]) < 0 ||
+	    statement >= optimizer->top)
+		return 0;
+
+	proc = ast->statements[statement];
+	body = ast->blocks[proc.proc.body];
+	if (call.arity != proc.arity || body.count != 1 ||
+	    ast->statements[body.first].type != STAT_RETURN)
+		return 0;
+
+	value = ast->statements[body.first].return_.value;
+	size  = CallFreeSize(ast, value);
+	if (size < 0) return 0;
+
+	for (i = 0; i < call.arity; i++) {
+		argument = ast->lists[call.call.arguments + i];
+		uses     = CountUses(ast, value, ast->lists[proc.proc.arguments + i]);
+		for (j = i + 1; j < call.arity; j++) {
+			if (ast->lists[proc.proc.arguments + j] == ast->lists[proc.proc.arguments + i]) uses = 0;
+		}
+
+		/* an argument that is not used is dropped, names in it are not read */
+		if (!IsPure(ast, argument, uses > 0)) return 0;
+		size += uses * (CallFreeSize(ast, argument) - 1);
+	}
+	if (size > inline_budget) return 0;
+
+	value = Substitute(ast, value, proc.proc.arguments, call.call.arguments, call.arity);
+	Rewrite(ast, index, ast->expressions[value], "inlined call");
+	return 1;
+}
+
+/* Children first, so that folded operands fold their parents in turn */
+static void
+OptimizeExpression(Optimizer *optimizer, int index)
+{
+	Ast       *ast        = optimizer->ast;
+	Expression expression = ast->expressions[index];
+	int        i;
+
+	switch (expression.type) {
+	case EXPR_CALL:
+		for (i = 0; i < expression.arity; i++)
+			OptimizeExpression(optimizer, ast->lists[expression.call.arguments + i]);
+		/* constant arguments fold into the inlined tree */
+		if (Inline(optimizer, index)) OptimizeExpression(optimizer, index);
+		break;
+	case EXPR_PREFIX:
+		OptimizeExpression(optimizer, expression.prefix.value);
+		SimplifyPrefix(ast, index);
+		break;
+	case EXPR_INFIX:
+		OptimizeExpression(optimizer, expression.infix.value1);
+		OptimizeExpression(optimizer, expression.infix.value2);
+		SimplifyInfix(ast, index);
+		break;
+	default: break;
+	}
+}
+
+/* The expression a statement evaluates, if any */
+static int *
+StatementValue(Statement *statement)
+{
+	switch (statement->type) {
+	case STAT_EXPR: return &statement->expression.expression;
+	case STAT_LET: return &statement->let.value;
+	case STAT_RETURN: return &statement->return_.value;
+	default: return NULL;
+	}
+}
+
+/* Procs are simplified in order, so a body is final before the calls that
+ * come after it inline it */
+static void
+Simplify(Optimizer *optimizer, int block, int top)
+{
+	Ast           *ast  = optimizer->ast;
+	BlockStatement body = ast->blocks[block];
+	Statement      statement;
+	int           *value, i;
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		statement = ast->statements[i];
+		if (top) optimizer->top = i;
+
+		if ((value = StatementValue(&statement))) OptimizeExpression(optimizer, *value);
+		else if (statement.type == STAT_PROC) Simplify(optimizer, statement.proc.body, 0);
+	}
+}
+
+/* After everything is inlined, bodies copied into calls are shared there */
+static void
+Share(Optimizer *optimizer, int block)
+{
+	Ast           *ast  = optimizer->ast;
+	BlockStatement body = ast->blocks[block];
+	Statement      statement;
+	int           *value, slot, i;
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		statement = ast->statements[i];
+
+		if ((value = StatementValue(&statement))) {
+			for (slot = 0; ShareOne(ast, *value, slot, &optimizer->candidates); slot++);
+		} else if (statement.type == STAT_PROC && ast->blocks[statement.proc.body].first >= 0) {
+			Share(optimizer, statement.proc.body);
+		}
+	}
+}
+
+/* Statements after a return are never evaluated */
+static void
+DropUnreachable(Ast *ast, int block)
+{
+	BlockStatement *body = &ast->blocks[block];
+	Statement       statement;
+	int             row, column, i;
+
+	for (i = body->first; i < body->first + body->count; i++) {
+		statement = ast->statements[i];
+
+		if (statement.type == STAT_PROC && ast->blocks[statement.proc.body].first >= 0) {
+			DropUnreachable(ast, statement.proc.body);
+			body = &ast->blocks[block];
+		} else if (statement.type == STAT_RETURN && i + 1 < body->first + body->count) {
+			if (TRACING(TRACE_OPT, TRACE_BRIEF)) {
+				GetPosition(ast->tokens, ast->tokens->offsets[ast->statements[i + 1].token], &row,
+				            &column);
+				TRACE(TRACE_OPT, TRACE_BRIEF, "unreachable statements at line %d\n", row);
+			}
+			body->count = i + 1 - body->first;
+		}
+	}
+}
+
+/* A proc is live when its name is mentioned by code that runs, which is
+ * the top level and the bodies of live procs. Names are not resolved yet,
+ * so every proc of a mentioned name is live */
+typedef struct {
+	Ast  *ast;
+	char *mentioned; /* by symbol */
+	int  *procs;     /* by symbol, the last proc statement of the name or -1 */
+	int  *next;      /* by statement, the proc of the same name before it */
+	int  *work;      /* bodies still to be scanned */
+} Liveness;
+
+static void
+IndexProcs(Liveness *liveness, int block)
+{
+	Ast           *ast  = liveness->ast;
+	BlockStatement body = ast->blocks[block];
+	int            i, name;
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		if (ast->statements[i].type != STAT_PROC) continue;
+
+		name                  = ast->statements[i].proc.identifier;
+		liveness->next[i]     = liveness->procs[name];
+		liveness->procs[name] = i;
+		IndexProcs(liveness, ast->statements[i].proc.body);
+	}
+}
+
+static void
+Mention(Liveness *liveness, int symbol)
+{
+	int statement;
+
+	if (liveness->mentioned[symbol]) return;
+	liveness->mentioned[symbol] = 1;
+
+	for (statement = liveness->procs[symbol]; statement >= 0; statement = liveness->next[statement])
+		arrpush(liveness->work, liveness->ast->statements[statement].proc.body);
+}
+
+static void
+MentionExpression(Liveness *liveness, int index)
+{
+	Expression expression = liveness->ast->expressions[index];
+	int        i;
+
+	switch (expression.type) {
+	case EXPR_IDENTIFIER: Mention(liveness, expression.identifier.symbol); break;
+	case EXPR_CALL:
+		MentionExpression(liveness, expression.call.callee);
+		for (i = 0; i < expression.arity; i++)
+			MentionExpression(liveness, liveness->ast->lists[expression.call.arguments + i]);
+		break;
+	case EXPR_PREFIX: MentionExpression(liveness, expression.prefix.value); break;
+	case EXPR_INFIX:
+		MentionExpression(liveness, expression.infix.value1);
+		MentionExpression(liveness, expression.infix.value2);
+		break;
+	case EXPR_SHARED:
+		if (expression.shared.value >= 0) MentionExpression(liveness, expression.shared.value);
+		break;
+	default: break;
+	}
+}
+
+/* Procs in the block are not scanned here, only once their name is
+ * mentioned. A body that was skipped mentions every name among its tokens */
+static void
+Scan(Liveness *liveness, int block)
+{
+	Ast           *ast  = liveness->ast;
+	BlockStatement body = ast->blocks[block];
+	Statement      statement;
+	int           *value, i;
+
+	if (body.first < 0) {
+		for (i = body.token; i <= body.end; i++) {
+			if (ast->tokens->symbols[i] >= 0) Mention(liveness, ast->tokens->symbols[i]);
+		}
+		return;
+	}
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		statement = ast->statements[i];
+		if ((value = StatementValue(&statement))) MentionExpression(liveness, *value);
+	}
+}
+
+static void
+RemoveDead(Liveness *liveness, int block)
+{
+	Ast            *ast  = liveness->ast;
+	BlockStatement *body = &ast->blocks[block];
+	Statement       statement;
+	int             row, column, i, kept = body->first;
+
+	for (i = body->first; i < body->first + body->count; i++) {
+		statement = ast->statements[i];
+
+		if (statement.type == STAT_PROC) {
+			if (!liveness->mentioned[statement.proc.identifier]) {
+				if (TRACING(TRACE_OPT, TRACE_BRIEF)) {
+					GetPosition(ast->tokens, ast->tokens->offsets[statement.token], &row, &column);
+					TRACE(TRACE_OPT, TRACE_BRIEF, "dead proc %s at line %d\n",
+					      SymbolName(ast->symbols, statement.proc.identifier), row);
+				}
+				continue;
+			}
+			RemoveDead(liveness, statement.proc.body);
+			body = &ast->blocks[block];
+		}
+		ast->statements[kept++] = statement;
+	}
+	body->count = kept - body->first;
+}
+
+static void
+Prune(Ast *ast)
+{
+	Liveness liveness = {.ast = ast};
+	int      symbols  = arrlen(ast->symbols->names);
+	int      i;
+
+	arrsetlen(liveness.mentioned, symbols);
+	arrsetlen(liveness.procs, symbols);
+	arrsetlen(liveness.next, arrlen(ast->statements));
+	for (i = 0; i < symbols; i++) {
+		liveness.mentioned[i] = 0;
+		liveness.procs[i]     = -1;
+	}
+
+	IndexProcs(&liveness, ast->program);
+
+	arrpush(liveness.work, ast->program);
+	while (arrlen(liveness.work)) Scan(&liveness, arrpop(liveness.work));
+
+	/* calls in the procs about to go are still checked */
+	for (i = 0; i < symbols; i++) {
+		if (liveness.procs[i] >= 0 && !liveness.mentioned[i]) {
+			CheckArity(ast);
+			break;
+		}
+	}
+
+	RemoveDead(&liveness, ast->program);
+}
+
+/* The pools are copied from the program down and moved over the old ones,
+ * leaving out pruned procs and the nodes that rewrites replaced */
+typedef struct {
+	Ast            *ast;
+	Expression     *expressions;
+	Statement      *statements;
+	BlockStatement *blocks;
+	int            *lists;
+	Value          *constants;
+	int            *copied_expressions; /* old index -> new one, or -1 */
+	int            *copied_constants;
+} Compactor;
+
+static int
+CopyConstant(Compactor *compactor, int index)
+{
+	if (compactor->copied_constants[index] < 0) {
+		arrpush(compactor->constants, compactor->ast->constants[index]);
+		compactor->copied_constants[index] = arrlen(compactor->constants) - 1;
+	}
+	return compactor->copied_constants[index];
+}
+
+/* The lookup follows its constants to their copies, -1 for the ones left
+ * out, which PoolConstant adds again when they come up */
+static void
+CompactPool(Compactor *compactor, Constant *pool)
+{
+	int i;
+
+	for (i = 0; i < hmlen(pool); i++)
+		if (pool[i].value >= 0) pool[i].value = compactor->copied_constants[pool[i].value];
+}
+
+static int
+CopyExpression(Compactor *compactor, int index)
+{
+	Ast       *ast        = compactor->ast;
+	Expression expression = ast->expressions[index];
+	int        copy, i;
+
+	if (compactor->copied_expressions[index] >= 0) return compactor->copied_expressions[index];
+
+	switch (expression.type) {
+	case EXPR_CALL:
+		/* the list is reserved first, nested lists go after it */
+		copy = arrlen(compactor->lists);
+		arraddnptr(compactor->lists, expression.arity);
+		for (i = 0; i < expression.arity; i++) {
+			int argument = CopyExpression(compactor, ast->lists[expression.call.arguments + i]);
+			compactor->lists[copy + i] = argument;
+		}
+		expression.call.arguments = copy;
+		expression.call.callee    = CopyExpression(compactor, expression.call.callee);
+		break;
+	case EXPR_LITERAL:
+		expression.literal.constant = CopyConstant(compactor, expression.literal.constant);
+		break;
+	case EXPR_PREFIX: expression.prefix.value = CopyExpression(compactor, expression.prefix.value); break;
+	case EXPR_INFIX:
+		expression.infix.value1 = CopyExpression(compactor, expression.infix.value1);
+		expression.infix.value2 = CopyExpression(compactor, expression.infix.value2);
+		break;
+	case EXPR_SHARED:
+		if (expression.shared.value >= 0)
+			expression.shared.value = CopyExpression(compactor, expression.shared.value);
+		break;
+	default: break;
+	}
+
+	arrpush(compactor->expressions, expression);
+	compactor->copied_expressions[index] = arrlen(compactor->expressions) - 1;
+	return compactor->copied_expressions[index];
+}
+
+/* Skipped blocks keep first at -1 and are parsed into the new pools */
+static int
+CopyBlock(Compactor *compactor, int block)
+{
+	Ast           *ast  = compactor->ast;
+	BlockStatement body = ast->blocks[block];
+	Statement      statement;
+	int           *value, first, i;
+
+	if (body.first >= 0) {
+		/* the statements stay in one run, nested blocks go after it */
+		first = arrlen(compactor->statements);
+		arraddnptr(compactor->statements, body.count);
+
+		for (i = 0; i < body.count; i++) {
+			statement = ast->statements[body.first + i];
+
+			if ((value = StatementValue(&statement))) {
+				*value = CopyExpression(compactor, *value);
+			} else if (statement.type == STAT_PROC) {
+				int arguments = arrlen(compactor->lists);
+				if (statement.arity) {
+					arraddnptr(compactor->lists, statement.arity);
+					memcpy(compactor->lists + arguments, ast->lists + statement.proc.arguments,
+					       statement.arity * sizeof(int));
+				}
+				statement.proc.arguments = arguments;
+				statement.proc.body      = CopyBlock(compactor, statement.proc.body);
+			}
+			compactor->statements[first + i] = statement;
+		}
+		body.first = first;
+	}
+
+	arrpush(compactor->blocks, body);
+	return arrlen(compactor->blocks) - 1;
+}
+
+/* Nothing refers to nodes by index while this runs, nothing has been
+ * evaluated yet. Every node is copied at most once, the copies fit in the
+ * old pools */
+static void
+Compact(Ast *ast)
+{
+	Compactor compactor = {.ast = ast};
+	int       i;
+
+	arrsetlen(compactor.copied_expressions, arrlen(ast->expressions));
+	arrsetlen(compactor.copied_constants, arrlen(ast->constants));
+	for (i = 0; i < arrlen(ast->expressions); i++) compactor.copied_expressions[i] = -1;
+	for (i = 0; i < arrlen(ast->constants); i++) compactor.copied_constants[i] = -1;
+
+	ast->program = CopyBlock(&compactor, ast->program);
+
+#define MOVE_POOL(pool) \
+	do { \
+		if (arrlen(compactor.pool)) \
+			memcpy(ast->pool, compactor.pool, arrlen(compactor.pool) * sizeof(*ast->pool)); \
+		arrsetlen(ast->pool, arrlen(compactor.pool)); \
+	} while (0)
+
+	MOVE_POOL(expressions);
+	MOVE_POOL(statements);
+	MOVE_POOL(blocks);
+	MOVE_POOL(lists);
+	MOVE_POOL(constants);
+
+#undef MOVE_POOL
+
+	CompactPool(&compactor, ast->pool.integers);
+	CompactPool(&compactor, ast->pool.strings);
+}
+
+/* Bodies still waiting for a lazy parse are optimized once they are parsed.
+ * Inlining and pruning need to see the whole program, which a block given
+ * as `program` is, and are only done then */
+void
+Optimize(Ast *ast, int block, bool program)
+{
+	Optimizer    optimizer = {.ast = ast};
+	MemoryBlock *scratch, *outer;
+	long         mark;
+
+	if (ast->image || ast->blocks[block].first < 0) return;
+
+	scratch = ast->parser->scratch;
+	mark    = ArenaMark(scratch);
+	outer   = SetArrayArena(scratch);
+
+	DropUnreachable(ast, block);
+	if (program && inline_budget > 0) FindProcs(&optimizer);
+	Simplify(&optimizer, block, program);
+	if (program) Prune(ast);
+	Share(&optimizer, block);
+	if (program) Compact(ast);
+
+	SetArrayArena(outer);
+	ArenaReset(scratch, mark);
+}
@@ -0,0 +1,19 @@
+#ifndef optimize_h
+#define optimize_h
+
+#include "parse.h"
+
+/* Operators that are only produced by the optimizer, numbered after the
+ * tokens they share Expression.operator with */
+enum { OP_SHIFT_LEFT = TOK_INTEGER + 1 };
+
+/* Largest returned expression, in nodes, of a proc inlined at its calls */
+#define INLINE_BUDGET 32
+
+extern int inline_budget;
+
+/* Rewrites a freshly parsed block and the proc bodies in it in place. Trees
+ * loaded from an image were optimized before they were saved */
+void Optimize(Ast *, int, bool);
+
+#endif /* !optimize_h */
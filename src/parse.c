@@ -1,11 +1,15 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "arena.h"
 #include "lex.h"
+#include "optimize.h"
 #include "parse.h"
+#include "resolve.h"
 #include "stb_ds.h"
+#include "trace.h"
 #include "utils.h"
 
 Precedence TokenPrecedence[] = {
@@ -18,74 +22,199 @@ Precedence TokenPrecedence[] = {
 };
 
 Parser *
-CreateParser(Lexer *lexer)
+CreateParser(MemoryBlock *arena, MemoryBlock *scratch, Lexer *lexer)
 {
-	MemoryBlock *arena  = CreateArena();
 	Parser      *parser = ArenaAlloc(arena, sizeof(Parser));
-	*parser             = (Parser){.arena = arena, .lexer = lexer};
+	Ast         *ast    = ArenaAlloc(arena, sizeof(Ast));
+	TokenList   *tokens = Tokenize(lexer);
+	MemoryBlock *outer  = SetArrayArena(arena);
+
+	*ast    = (Ast){.tokens = tokens, .symbols = tokens->table, .parser = parser};
+	*parser = (Parser){.arena   = arena,
+	                   .scratch = scratch,
+	                   .lexer   = lexer,
+	                   .tokens  = tokens,
+	                   .ast     = ast,
+	                   .current = -1,
+	                   .peek    = 0};
+
+	/* the pools stay in the arena and grow there. Typical sources have an
+	 * expression per two tokens and a statement per eight, so sized from the
+	 * token count they rarely have to */
+	arrsetcap(ast->expressions, tokens->count / 2 + 16);
+	arrsetcap(ast->statements, tokens->count / 8 + 16);
+	arrsetcap(ast->blocks, tokens->count / 16 + 16);
+	arrsetcap(ast->lists, tokens->count / 8 + 16);
+	arrsetcap(ast->constants, tokens->count / 16 + 16);
+
+	SetArrayArena(outer);
 	return parser;
 }
 
+/* Lexes what was appended to the lexer's input since the last Parse, which
+ * the next Parse then continues with. The AST keeps growing, so nodes parsed
+ * before stay valid */
 void
-DestroyParser(Parser *parser)
+ContinueParser(Parser *parser)
 {
-	DestroyArena(parser->arena);
+	int first = parser->tokens->count - 1; /* the TOK_EOF being replaced */
+
+	Tokenize(parser->lexer);
+
+	parser->current = first - 1;
+	parser->peek    = first;
+}
+
+static TokenType
+CurrentType(Parser *parser)
+{
+	return parser->tokens->types[parser->current];
+}
+
+static TokenType
+PeekType(Parser *parser)
+{
+	return parser->tokens->types[parser->peek];
+}
+
+static int
+CurrentSymbol(Parser *parser)
+{
+	return parser->tokens->symbols[parser->current];
 }
 
 void
 ReadToken(Parser *parser)
 {
 	parser->current = parser->peek;
-	parser->peek    = NextToken(parser->lexer);
 
-	if (parser->current) {
-		printf(">\t");
-		Print(TokenString(parser->current));
-	}
+	/* the list ends with TOK_EOF, which is read over and over */
+	if (parser->peek < parser->tokens->count - 1) parser->peek++;
+
+	if (parser->current >= 0)
+		TRACE(TRACE_LEX, TRACE_BRIEF, ">\t%s\n", TokenString(parser->tokens, parser->current));
 }
 
 void
 ExpectToken(Parser *parser, TokenType type)
 {
+	int row, column;
+
 	ReadToken(parser);
-	if (parser->current->type == type) return;
+	if (CurrentType(parser) == type) return;
 
-	Token token = {.type = type};
-	fprintf(stderr, "Unexpected token: %s\n", TokenString(parser->current));
-	fprintf(stderr, "Expected: %s\n", TokenString(&token));
-	fprintf(stderr, "At line %d\n", parser->current->row);
+	GetPosition(parser->tokens, parser->tokens->offsets[parser->current], &row, &column);
+	fprintf(stderr, "Unexpected token: %s\n", TokenString(parser->tokens, parser->current));
+	fprintf(stderr, "Expected: %s()\n", TypeToString(type));
+	fprintf(stderr, "At line %d\n", row);
 	exit(200);
 }
 
-Statement *
+static int
+NewExpression(Parser *parser, Expression expression)
+{
+	arrpush(parser->ast->expressions, expression);
+	return arrlen(parser->ast->expressions) - 1;
+}
+
+/* The name at the current token, bound to a slot once Resolve has run */
+static int
+NewIdentifier(Parser *parser)
+{
+	return NewExpression(parser, (Expression){.type              = EXPR_IDENTIFIER,
+	                                          .token             = parser->current,
+	                                          .identifier.symbol = CurrentSymbol(parser),
+	                                          .identifier.depth  = SCOPE_UNRESOLVED});
+}
+
+/* Lists are gathered on the parser's stack, where a nested list is built on
+ * top of the one it belongs to and is gone before that one grows again. A
+ * list starts at the stack mark taken before its first element */
+static int
+StackMark(Parser *parser)
+{
+	return arrlen(parser->stack);
+}
+
+static void
+StackPush(Parser *parser, void *element, int size)
+{
+	memcpy(arraddnptr(parser->stack, size), element, size);
+}
+
+static int
+StackCount(Parser *parser, int mark, int size)
+{
+	return (arrlen(parser->stack) - mark) / size;
+}
+
+/* Moves the list from `mark` on to the end of Ast.lists, returns where it
+ * starts */
+static int
+CommitList(Parser *parser, int mark)
+{
+	int first = arrlen(parser->ast->lists);
+	int count = StackCount(parser, mark, sizeof(int));
+
+	if (count) {
+		memcpy(arraddnptr(parser->ast->lists, count), parser->stack + mark,
+		       count * sizeof(int));
+	}
+	arrsetlen(parser->stack, mark);
+	return first;
+}
+
+/* Moves the statements from `mark` on to the end of Ast.statements, returns
+ * the block made of them */
+static int
+CommitBlock(Parser *parser, int token, int mark)
+{
+	Ast           *ast   = parser->ast;
+	BlockStatement block = {.token = token,
+	                        .end   = parser->current,
+	                        .first  = arrlen(ast->statements),
+	                        .count  = StackCount(parser, mark, sizeof(Statement)),
+	                        .parent = -1};
+
+	if (block.count) {
+		memcpy(arraddnptr(ast->statements, block.count), parser->stack + mark,
+		       block.count * sizeof(Statement));
+	}
+	arrsetlen(parser->stack, mark);
+
+	arrpush(ast->blocks, block);
+	return arrlen(ast->blocks) - 1;
+}
+
+Ast *
 Parse(Parser *parser)
 {
-	Statement *program;
+	long         mark  = ArenaMark(parser->scratch);
+	MemoryBlock *outer = SetArrayArena(parser->scratch);
 
-	ReadToken(parser);
+	arrsetcap(parser->stack, 1 << 12);
 
-	Statement *statements = NULL;
 	for (;;) {
 		Statement statement = ParseStatement(parser);
 		if (!statement.type) break;
 
-		arrpush(statements, statement);
-		PrintStatement(&statement);
+		StackPush(parser, &statement, sizeof(Statement));
+		if (TRACING(TRACE_PARSE, TRACE_BRIEF)) PrintStatement(parser->ast, &statement);
 	}
 
-	arrpush(statements, (Statement){.type = STAT_INVALID});
-	program = ArenaAlloc(parser->arena, arrlen(statements) * sizeof(Statement));
-	memcpy(program, statements, arrlen(statements) * sizeof(Statement));
-	arrfree(statements);
+	parser->ast->program = CommitBlock(parser, 0, 0);
+	parser->stack        = NULL;
 
-	return program;
+	SetArrayArena(outer);
+	ArenaReset(parser->scratch, mark);
 
+	return parser->ast;
 }
 
 Statement
 ParseStatement(Parser *parser)
 {
-	switch (parser->peek->type) {
+	switch (PeekType(parser)) {
 	case TOK_PROC: return ParseProcStatement(parser);
 	case TOK_LET: return ParseLetStatement(parser);
 	case TOK_RETURN: return ParseReturnStatement(parser);
@@ -96,144 +225,220 @@ ParseStatement(Parser *parser)
 	}
 }
 
-BlockStatement
+int
 ParseBlockStatement(Parser *parser)
 {
-	BlockStatement block;
-	Statement *statements = NULL;
+	int mark = StackMark(parser);
+	int token;
 
 	ExpectToken(parser, TOK_L_BRACE);
-	while (parser->peek->type != TOK_R_BRACE) {
+	token = parser->current;
+	while (PeekType(parser) != TOK_R_BRACE) {
 		Statement statement = ParseStatement(parser);
 		if (!statement.type) break;
 
-		arrpush(statements, statement);
-		PrintStatement(&statement);
+		StackPush(parser, &statement, sizeof(Statement));
+		/* the enclosing statement prints these again once it is complete */
+		if (TRACING(TRACE_PARSE, TRACE_VERBOSE)) PrintStatement(parser->ast, &statement);
 	}
 	ExpectToken(parser, TOK_R_BRACE);
 
-	arrpush(statements, (Statement){.type = STAT_INVALID});
-	block.count      = arrlen(statements);
-	block.statements = ArenaAlloc(parser->arena, block.count * sizeof(Statement));
-	memcpy(block.statements, statements, block.count * sizeof(Statement));
-	arrfree(statements);
+	return CommitBlock(parser, token, mark);
+}
+
+/* Finds the brace closing the block at peek, or returns -1 */
+static int
+MatchBrace(Parser *parser)
+{
+	TokenList *tokens = parser->tokens;
+	int        depth  = 0;
+	int        i;
 
-	return block;
+	for (i = parser->peek; i < tokens->count; i++) {
+		if (tokens->types[i] == TOK_L_BRACE) depth++;
+		else if (tokens->types[i] == TOK_R_BRACE && --depth == 0) return i;
+	}
+	return -1;
+}
+
+/* Records where a proc body is and steps over it. Anything that is not a
+ * complete block is parsed right away to report the error */
+static int
+SkipBlock(Parser *parser)
+{
+	BlockStatement block = {.token = parser->peek, .first = -1, .parent = -1};
+
+	if (PeekType(parser) != TOK_L_BRACE || (block.end = MatchBrace(parser)) < 0)
+		return ParseBlockStatement(parser);
+
+	/* the closing brace is never the last token, TOK_EOF is */
+	parser->current = block.end;
+	parser->peek    = block.end + 1;
+
+	arrpush(parser->ast->blocks, block);
+	return arrlen(parser->ast->blocks) - 1;
+}
+
+/* Parses a block left behind by SkipBlock, which is done on the first call
+ * of its proc. Syntax errors in it are only reported then */
+void
+ParseSkippedBlock(Parser *parser, int block)
+{
+	Ast         *ast     = parser->ast;
+	int          current = parser->current;
+	int          peek    = parser->peek;
+	long         mark    = ArenaMark(parser->scratch);
+	MemoryBlock *outer   = SetArrayArena(parser->scratch);
+	int          parent  = ast->blocks[block].parent;
+	int          parsed;
+
+	parser->peek    = ast->blocks[block].token;
+	parser->current = parser->peek - 1;
+	arrsetcap(parser->stack, 1 << 10);
+
+	/* nested blocks are added first, so the new one is the last */
+	parsed             = ParseBlockStatement(parser);
+	ast->blocks[block]        = ast->blocks[parsed];
+	ast->blocks[block].parent = parent;
+	arrpop(ast->blocks);
+
+	parser->stack   = NULL;
+	parser->current = current;
+	parser->peek    = peek;
+
+	SetArrayArena(outer);
+	ArenaReset(parser->scratch, mark);
+
+	Optimize(ast, block, false);
+	Resolve(ast, block, false);
+}
+
+/* Parses every block skipped so far, including those found in the process */
+void
+ParseSkippedBlocks(Parser *parser)
+{
+	int i;
+
+	for (i = 0; i < arrlen(parser->ast->blocks); i++) {
+		if (parser->ast->blocks[i].first < 0) ParseSkippedBlock(parser, i);
+	}
 }
 
 Statement
 ParseProcStatement(Parser *parser)
 {
+	Statement statement = {.type = STAT_PROC};
+	int       mark      = StackMark(parser);
+	int       argument;
+
 	ExpectToken(parser, TOK_PROC);
-	ProcStatement statement;
 
 	ExpectToken(parser, TOK_IDENTIFIER);
-	statement.identifier = parser->current;
+	statement.token           = parser->current;
+	statement.proc.identifier = CurrentSymbol(parser);
 
 	ExpectToken(parser, TOK_L_PAREN);
-	Token **arguments = NULL;
 
-	if (parser->peek->type != TOK_R_PAREN) {
+	if (PeekType(parser) != TOK_R_PAREN) {
 		ExpectToken(parser, TOK_IDENTIFIER);
-		arrpush(arguments, parser->current);
-		while (parser->peek->type == TOK_COMMA) {
+		argument = CurrentSymbol(parser);
+		StackPush(parser, &argument, sizeof(int));
+		while (PeekType(parser) == TOK_COMMA) {
 			ReadToken(parser);
 			ExpectToken(parser, TOK_IDENTIFIER);
-			arrpush(arguments, parser->current);
+			argument = CurrentSymbol(parser);
+			StackPush(parser, &argument, sizeof(int));
 		}
 	}
-	
-	statement.arity = arrlen(arguments);
-	if (statement.arity > 0) {
-		statement.arguments = ArenaAlloc(parser->arena, statement.arity * sizeof(Token *));
-		memcpy(statement.arguments, arguments, statement.arity * sizeof(Token *));
-	}
-	arrfree(arguments);
+
+	statement.arity          = StackCount(parser, mark, sizeof(int));
+	statement.proc.arguments = CommitList(parser, mark);
 
 	ExpectToken(parser, TOK_R_PAREN);
 
-	statement.body  = ArenaAlloc(parser->arena, sizeof(BlockStatement));
-	*statement.body = ParseBlockStatement(parser);
+	statement.proc.body = parser->lazy ? SkipBlock(parser) : ParseBlockStatement(parser);
 
-	return (Statement){.type = STAT_PROC, .proc = statement};
+	return statement;
 }
 
 Statement
 ParseExpressionStatement(Parser *parser)
 {
-	Expression *expression = ParseExpression(parser, PREC_MIN);
+	Statement statement = {.type = STAT_EXPR, .token = parser->peek};
+
+	statement.expression.expression = ParseExpression(parser, PREC_MIN);
 
 	ExpectToken(parser, TOK_SEMICOLON);
 
-	return (Statement){.type = STAT_EXPR, .expression.expression = expression};
+	return statement;
 }
 
-CallExpression
+int
 ParseCallExpression(Parser *parser)
 {
-	CallExpression expression = {.procedure = parser->current};
+	Expression expression = {.type        = EXPR_CALL,
+	                         .token       = parser->current,
+	                         .call.callee = NewIdentifier(parser)};
+	int        mark       = StackMark(parser);
+	int        argument;
 
-	Expression **arguments = NULL;
 	ExpectToken(parser, TOK_L_PAREN);
 
-	if (parser->peek->type != TOK_R_PAREN) {
-		arrpush(arguments, ParseExpression(parser, PREC_MIN));
-		while (parser->peek->type == TOK_COMMA) {
+	if (PeekType(parser) != TOK_R_PAREN) {
+		argument = ParseExpression(parser, PREC_MIN);
+		StackPush(parser, &argument, sizeof(int));
+		while (PeekType(parser) == TOK_COMMA) {
 			ReadToken(parser);
-			arrpush(arguments, ParseExpression(parser, PREC_MIN));
+			argument = ParseExpression(parser, PREC_MIN);
+			StackPush(parser, &argument, sizeof(int));
 		}
 	}
-	
-	expression.arity = arrlen(arguments);
-	if (expression.arity > 0) {
-		expression.arguments = ArenaAlloc(parser->arena, expression.arity * sizeof(Expression *));
-		memcpy(expression.arguments, arguments, expression.arity * sizeof(Expression *));
-	}
-	arrfree(arguments);
+
+	expression.arity          = StackCount(parser, mark, sizeof(int));
+	expression.call.arguments = CommitList(parser, mark);
 
 	ExpectToken(parser, TOK_R_PAREN);
 
-	return expression;
+	return NewExpression(parser, expression);
 }
 
-Expression *
+/* Children are parsed first, so nodes are only added once complete */
+int
 ParseExpression(Parser *parser, Precedence precedence)
 {
-	ReadToken(parser);
+	TokenType operator;
+	int       left, value, token;
 
-	Expression *left;
+	ReadToken(parser);
+	token = parser->current;
 
-	if (parser->current->type == TOK_L_PAREN) {
+	switch (CurrentType(parser)) {
+	case TOK_L_PAREN:
 		left = ParseExpression(parser, PREC_MIN);
 		ExpectToken(parser, TOK_R_PAREN);
-	} else left = ArenaAlloc(parser->arena, sizeof(Expression));
-
-	switch (parser->current->type) {
+		break;
 	case TOK_MINUS:
 	case TOK_NOT:
-		left->type = EXPR_PREFIX;
-		left->prefix =
-			(PrefixExpression){.operator= parser->current,
-		                       .value = ParseExpression(parser, PREC_PREFIX)};
+		operator = CurrentType(parser);
+		value    = ParseExpression(parser, PREC_PREFIX);
+		left     = NewExpression(parser, (Expression){.type         = EXPR_PREFIX,
+		                                              .operator     = operator,
+		                                              .token        = token,
+		                                              .prefix.value = value});
 		break;
 	case TOK_IDENTIFIER:
-		if (parser->peek->type == TOK_L_PAREN) {
-			left->type = EXPR_CALL;
-			left->call = ParseCallExpression(parser);
+		if (PeekType(parser) == TOK_L_PAREN) {
+			left = ParseCallExpression(parser);
 		} else {
-			left->type       = EXPR_IDENTIFIER;
-			left->identifier = (IdentifierExpression){.value = parser->current};
+			left = NewIdentifier(parser);
 		}
 		break;
 	case TOK_STRING:
-	case TOK_INTEGER:
-		left->type    = EXPR_LITERAL;
-		left->literal = (LiteralExpression){.value = parser->current};
-		break;
-	default: break;
+	case TOK_INTEGER: left = ParseLiteralExpression(parser); break;
+	default: left = NewExpression(parser, (Expression){.type = EXPR_INVALID, .token = token});
 	}
 
-	switch (parser->peek->type) {
+	switch (PeekType(parser)) {
 	case TOK_PLUS:
 	case TOK_MINUS:
 	case TOK_STAR:
@@ -242,73 +447,146 @@ ParseExpression(Parser *parser, Precedence precedence)
 	default: return left;
 	}
 
-	InfixExpression infix = {0};
-	while (parser->peek->type != TOK_SEMICOLON) {
-		if (precedence >= TokenPrecedence[parser->peek->type]) break;
+	while (PeekType(parser) != TOK_SEMICOLON) {
+		if (precedence >= TokenPrecedence[PeekType(parser)]) break;
 		ReadToken(parser);
-		infix.value1 = left;
-		infix.operator= parser->current;
-		infix.value2 =
-			ParseExpression(parser, TokenPrecedence[parser->current->type]);
-		left        = ArenaAlloc(parser->arena, sizeof(Expression));
-		left->type  = EXPR_INFIX;
-		left->infix = infix;
+		token    = parser->current;
+		operator = CurrentType(parser);
+		value    = ParseExpression(parser, TokenPrecedence[operator]);
+		left     = NewExpression(parser, (Expression){.type     = EXPR_INFIX,
+		                                              .operator = operator,
+		                                              .token    = token,
+		                                              .infix    = {left, value}});
 	}
 
 	return left;
 }
 
+int
+ParseLiteralExpression(Parser *parser)
+{
+	switch (CurrentType(parser)) {
+	case TOK_INTEGER: return ParseIntegerLiteral(parser);
+	case TOK_STRING: return ParseStringLiteral(parser);
+	default: return NewExpression(parser, (Expression){.token = parser->current});
+	}
+}
+
+/* The index of the constant in `pool` under `key`, added with `value` if
+ * there is none or Compact left it out. The lookup lives as long as the
+ * tree, in its arena, and even a lookup may allocate it */
+int
+PoolConstant(Ast *ast, Constant **pool, int key, Value value)
+{
+	MemoryBlock *outer = SetArrayArena(ast->parser->arena);
+	int          index = hmgeti(*pool, key);
+
+	if (index >= 0 && (*pool)[index].value >= 0) {
+		index = (*pool)[index].value;
+	} else {
+		arrpush(ast->constants, value);
+		index = arrlen(ast->constants) - 1;
+		hmput(*pool, key, index);
+	}
+
+	SetArrayArena(outer);
+	return index;
+}
+
+int
+ParseIntegerLiteral(Parser *parser)
+{
+	char *text    = parser->tokens->input + parser->tokens->offsets[parser->current];
+	int   length  = parser->tokens->lengths[parser->current];
+	long  integer = 0;
+	int   i, row, column;
+
+	for (i = 0; i < length; i++) {
+		integer = integer * 10 + (text[i] - '0');
+		if (integer > INT_MAX) {
+			GetPosition(parser->tokens, parser->tokens->offsets[parser->current], &row, &column);
+			fprintf(stderr, "Integer literal out of range: %.*s\n", length, text);
+			fprintf(stderr, "At line %d\n", row);
+			exit(200);
+		}
+	}
+
+	Value      value      = {.type = VAL_INTEGER, .integer = integer};
+	Expression expression = {.type = EXPR_LITERAL, .token = parser->current};
+
+	expression.literal.constant = PoolConstant(parser->ast, &parser->ast->pool.integers, integer, value);
+	return NewExpression(parser, expression);
+}
+
+/* Strings share the interned storage of identifiers */
+int
+ParseStringLiteral(Parser *parser)
+{
+	TokenList *tokens = parser->tokens;
+	int        symbol = Intern(tokens->table, tokens->input + tokens->offsets[parser->current],
+	                           tokens->lengths[parser->current]);
+
+	Value      value      = {.type = VAL_STRING, .string = SymbolName(tokens->table, symbol)};
+	Expression expression = {.type = EXPR_LITERAL, .token = parser->current};
+
+	expression.literal.constant = PoolConstant(parser->ast, &parser->ast->pool.strings, symbol, value);
+	return NewExpression(parser, expression);
+}
+
 Statement
 ParseLetStatement(Parser *parser)
 {
-	LetStatement statement = {0};
+	Statement statement = {.type = STAT_LET};
 
 	ExpectToken(parser, TOK_LET);
 
 	ExpectToken(parser, TOK_IDENTIFIER);
-	statement.identifier = parser->current;
+	statement.token          = parser->current;
+	statement.let.identifier = CurrentSymbol(parser);
 
 	ExpectToken(parser, TOK_ASSIGN);
 
-	Expression *value = ParseExpression(parser, PREC_MIN);
-	if (value->type) statement.value = value;
-	else return (Statement){0};
+	statement.let.value = ParseExpression(parser, PREC_MIN);
+	if (!parser->ast->expressions[statement.let.value].type) return (Statement){0};
 
 	ExpectToken(parser, TOK_SEMICOLON);
 
-	return (Statement){.type = STAT_LET, .let = statement};
+	return statement;
 }
 
 Statement
 ParseReturnStatement(Parser *parser)
 {
-	ReturnStatement statement = {.start = parser->current};
+	Statement statement = {.type = STAT_RETURN};
 
 	ExpectToken(parser, TOK_RETURN);
+	statement.token = parser->current;
 
-	Expression *value = ParseExpression(parser, PREC_MIN);
-	if (value->type) statement.value = value;
-	else return (Statement){0};
+	statement.return_.value = ParseExpression(parser, PREC_MIN);
+	if (!parser->ast->expressions[statement.return_.value].type) return (Statement){0};
 
 	ExpectToken(parser, TOK_SEMICOLON);
 
-	return (Statement){.type = STAT_RETURN, .return_ = statement};
+	return statement;
 }
 
 void
-PrintExpression(Expression *expression)
+PrintExpression(Ast *ast, int index)
 {
+	Expression *expression = &ast->expressions[index];
+	TokenList  *tokens     = ast->tokens;
+	int         i;
+
 	switch (expression->type) {
 	case EXPR_CALL:
 		Print("CALL_EXPRESSION:");
 		BeginIndent();
 
-		Print("Procedure: %s", TokenString(expression->call.procedure));
+		Print("Procedure: %s", TokenString(tokens, expression->token));
 		Print("Arguments:");
 		BeginIndent();
-		int i;
-		for (i = 0; i < expression->call.arity; i++) {
-			PrintExpression(expression->call.arguments[i]);
+		for (i = 0; i < expression->arity; i++) {
+			PrintExpression(ast, ast->lists[expression->call.arguments + i]);
 		}
 		EndIndent();
 
@@ -318,7 +596,7 @@ PrintExpression(Expression *expression)
 		Print("IDENTIFIER_EXPRESSION:");
 		BeginIndent();
 
-		Print("Value: %s", TokenString(expression->identifier.value));
+		Print("Value: %s", TokenString(tokens, expression->token));
 
 		EndIndent();
 		break;
@@ -326,7 +604,7 @@ PrintExpression(Expression *expression)
 		Print("LITERAL_EXPRESSION:");
 		BeginIndent();
 
-		Print("Value: %s", TokenString(expression->literal.value));
+		Print("Value: %s", TokenString(tokens, expression->token));
 
 		EndIndent();
 		break;
@@ -334,11 +612,11 @@ PrintExpression(Expression *expression)
 		Print("PREFIX_EXPRESSION:");
 		BeginIndent();
 
-		Print("Operator: %s", TokenString(expression->prefix.operator));
+		Print("Operator: %s", TokenString(tokens, expression->token));
 
 		Print("Value:");
 		BeginIndent();
-		PrintExpression(expression->prefix.value);
+		PrintExpression(ast, expression->prefix.value);
 		EndIndent();
 
 		EndIndent();
@@ -347,16 +625,16 @@ PrintExpression(Expression *expression)
 		Print("INFIX_EXPRESSION");
 		BeginIndent();
 
-		Print("Operator: %s", TokenString(expression->infix.operator));
+		Print("Operator: %s", TokenString(tokens, expression->token));
 
 		Print("Value1:");
 		BeginIndent();
-		PrintExpression(expression->infix.value1);
+		PrintExpression(ast, expression->infix.value1);
 		EndIndent();
 
 		Print("Value2:");
 		BeginIndent();
-		PrintExpression(expression->infix.value2);
+		PrintExpression(ast, expression->infix.value2);
 		EndIndent();
 
 		EndIndent();
@@ -366,29 +644,35 @@ PrintExpression(Expression *expression)
 }
 
 void
-PrintStatement(Statement *statement)
+PrintStatement(Ast *ast, Statement *statement)
 {
+	TokenList      *tokens = ast->tokens;
+	BlockStatement *body;
+	int             i;
+
 	switch (statement->type) {
 	case STAT_PROC:
 		Print("PROC_STATEMENT:");
 		BeginIndent();
 
-		Print("Identifier: %s", TokenString(statement->proc.identifier));
+		Print("Identifier: %s", TokenString(tokens, statement->token));
 
-		Print("Arity: %d", statement->proc.arity);
+		Print("Arity: %d", statement->arity);
 
 		Print("Arguments:");
 		BeginIndent();
-		int i;
-		for (i = 0; i < statement->proc.arity; i++) {
-			Print(TokenString(statement->proc.arguments[i]));
+		for (i = 0; i < statement->arity; i++) {
+			Print("IDENTIFIER(%s)",
+			      SymbolName(ast->symbols, ast->lists[statement->proc.arguments + i]));
 		}
 		EndIndent();
 
 		Print("Body:");
 		BeginIndent();
-		for (i = 0; i < statement->proc.body->count; i++) {
-			PrintStatement(&statement->proc.body->statements[i]);
+		body = &ast->blocks[statement->proc.body];
+		if (body->first < 0) Print("(parsed on first call)");
+		for (i = 0; i < body->count; i++) {
+			PrintStatement(ast, &ast->statements[body->first + i]);
 		}
 		EndIndent();
 
@@ -398,11 +682,11 @@ PrintStatement(Statement *statement)
 		Print("LET_STATEMENT:");
 		BeginIndent();
 
-		Print("Identifier: %s", TokenString(statement->let.identifier));
+		Print("Identifier: %s", TokenString(tokens, statement->token));
 
 		Print("Value:");
 		BeginIndent();
-		PrintExpression(statement->let.value);
+		PrintExpression(ast, statement->let.value);
 		EndIndent();
 
 		EndIndent();
@@ -413,7 +697,7 @@ PrintStatement(Statement *statement)
 
 		Print("Value:");
 		BeginIndent();
-		PrintExpression(statement->let.value);
+		PrintExpression(ast, statement->return_.value);
 		EndIndent();
 
 		EndIndent();
@@ -424,7 +708,7 @@ PrintStatement(Statement *statement)
 
 		Print("Expression:");
 		BeginIndent();
-		PrintExpression(statement->expression.expression);
+		PrintExpression(ast, statement->expression.expression);
 		EndIndent();
 
 		EndIndent();
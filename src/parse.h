@@ -16,121 +16,213 @@ typedef enum {
 } Precedence;
 
 typedef struct {
-	Lexer       *lexer;
-	Token       *current;
-	Token       *peek;
-	MemoryBlock *arena;
-} Parser;
+	enum {
+		VAL_NONE,
+		VAL_PROC,
+		VAL_INTEGER,
+		VAL_STRING,
+	} type;
+	union {
+		struct {
+			int procedure;   /* statement */
+			int environment; /* frame the proc was defined in, -1 at the top level */
+		};
+		int   integer;
+		char *string;
+	};
+} Value;
+
+/* Literals are decoded once while parsing. Equal literals share a single
+ * constant, found by the decoded integer or the interned string, and so do
+ * the values the optimizer folds */
+typedef struct {
+	int key;
+	int value; /* index into Ast.constants */
+} Constant;
+
+typedef struct {
+	Constant *integers;
+	Constant *strings;
+} ConstantPool;
 
+/* Nodes live in typed pools and refer to each other, to their tokens and to
+ * constants by index. Names are kept as symbol ids */
 typedef struct {
-	Token              *procedure;
-	char                arity;
-	struct Expression **arguments;
+	int callee;    /* identifier expression of the proc */
+	int arguments; /* first of `arity` expressions in Ast.lists */
 } CallExpression;
 
+/* Filled in by Resolve: the name is bound in slot `slot` of the frame of
+ * the proc `depth` procs out from the innermost one around it, or is a
+ * global, and the globals are indexed by symbol */
 typedef struct {
-	Token *value;
+	int   symbol;
+	short depth;
+	short slot;
 } IdentifierExpression;
 
+enum { SCOPE_GLOBAL = -1, SCOPE_UNRESOLVED = -2 };
+
+/* A callee linked by Resolve to the only proc its name can be bound to,
+ * which was defined `depth` procs out, or at the top level */
 typedef struct {
-	Token *value;
+	int statement;
+	int depth;
+} ProcedureExpression;
+
+typedef struct {
+	int constant;
 } LiteralExpression;
 
 typedef struct {
-	Token             *operator;
-	struct Expression *value;
+	int value;
 } PrefixExpression;
 
 typedef struct {
-	Token             *operator;
-	struct Expression *value1, *value2;
+	int value1, value2;
 } InfixExpression;
 
-typedef struct Expression {
-	enum {
-		EXPR_INVALID,
-		EXPR_CALL,
-		EXPR_IDENTIFIER,
-		EXPR_LITERAL,
-		EXPR_INFIX,
-		EXPR_PREFIX
-	} type;
+/* A subexpression that occurs more than once in a statement. The first
+ * occurrence evaluates `value` into a slot of the call, the others have -1
+ * and read the slot */
+typedef struct {
+	int slot;
+	int value;
+} SharedExpression;
+
+typedef struct {
+	unsigned char type;
+	unsigned char operator; /* TokenType of prefix and infix expressions */
+	unsigned char arity;    /* of calls */
+	int           token;
 	union {
 		CallExpression       call;
 		IdentifierExpression identifier;
+		ProcedureExpression  procedure;
 		LiteralExpression    literal;
 		PrefixExpression     prefix;
 		InfixExpression      infix;
+		SharedExpression     shared;
 	};
 } Expression;
 
-typedef struct ExpressionStatement {
-	Expression *expression;
-} ExpressionStatement;
-
-typedef struct BlockStatement {
-	Token            *start;
-	int               count;
-	struct Statement *statements;
+enum {
+	EXPR_INVALID,
+	EXPR_CALL,
+	EXPR_IDENTIFIER,
+	EXPR_LITERAL,
+	EXPR_INFIX,
+	EXPR_PREFIX,
+	EXPR_SHARED,
+	EXPR_PROCEDURE
+};
+
+/* The statements of a block are stored one after another. Blocks skipped
+ * by a lazy parser have `first` set to -1 until they are parsed */
+typedef struct {
+	int token; /* opening brace */
+	int end;   /* closing brace */
+	int first;
+	int count;
+	int parent; /* block defining the proc of a body, -1 for the program */
+	int locals; /* slots in the frame of a proc body */
 } BlockStatement;
 
-typedef struct LetStatement {
-	Token      *identifier;
-	Expression *value;
+typedef struct {
+	int expression;
+} ExpressionStatement;
+
+typedef struct {
+	int identifier; /* symbol */
+	int value;
 } LetStatement;
 
-typedef struct ReturnStatement {
-	Token      *start;
-	Expression *value;
+typedef struct {
+	int value;
 } ReturnStatement;
 
-typedef struct ProcStatement {
-	Token          *identifier;
-	char            arity;
-	Token         **arguments;
-	BlockStatement *body;
+typedef struct {
+	int identifier; /* symbol */
+	int arguments;  /* first of `arity` symbols in Ast.lists */
+	int body;       /* block */
 } ProcStatement;
 
-typedef struct Statement {
-	enum {
-		STAT_INVALID,
-		STAT_EXPR,
-		STAT_BLOCK,
-		STAT_LET,
-		STAT_RETURN,
-		STAT_PROC
-	} type;
+typedef struct {
+	unsigned char type;
+	unsigned char arity; /* of procs */
+	short         slot;  /* bound by a let or proc inside a proc, see Resolve */
+	int           token;
 	union {
 		ExpressionStatement expression;
 		ProcStatement       proc;
 		LetStatement        let;
 		ReturnStatement     return_;
-		BlockStatement      block;
 	};
 } Statement;
 
-Parser *CreateParser(Lexer *);
-void    DestroyParser(Parser *);
+enum {
+	STAT_INVALID,
+	STAT_EXPR,
+	STAT_LET,
+	STAT_RETURN,
+	STAT_PROC
+};
 
-void ReadToken(Parser *);
-void ExpectToken(Parser *, TokenType);
-
-void PrintStatement(Statement *);
-void PrintExpression(Expression *);
+/* The pools are stb_ds arrays, except in a tree loaded from an image, where
+ * they point into the read-only mapping and `tokens` and `parser` are NULL */
+typedef struct {
+	TokenList      *tokens;
+	SymbolTable    *symbols;
+	Expression     *expressions;
+	Statement      *statements;
+	BlockStatement *blocks;
+	int            *lists;
+	Value          *constants;
+	ConstantPool    pool;    /* lookup of the constants, for every parse */
+	int             program; /* block */
+	int            *globals; /* symbol -> proc statement, see Resolve */
+	struct Parser  *parser;  /* for blocks that were skipped */
+	char           *image;   /* mapping of a loaded image */
+	long            image_size;
+} Ast;
+
+typedef struct Parser {
+	Lexer       *lexer;
+	TokenList   *tokens;
+	Ast         *ast;
+	int          current; /* indices into tokens */
+	int          peek;
+	char        *stack; /* lists still being parsed, innermost on top */
+	bool         lazy;  /* skip proc bodies until they are called */
+	MemoryBlock *arena;
+	MemoryBlock *scratch; /* temporary arrays, released once parsing is done */
+} Parser;
 
-Statement     *Parse(Parser *);
-Statement      ParseStatement(Parser *);
-Statement      ParseExpressionStatement(Parser *);
-Statement      ParseLetStatement(Parser *);
-Statement      ParseReturnStatement(Parser *);
-Statement      ParseProcStatement(Parser *);
-BlockStatement ParseBlockStatement(Parser *);
+Parser *CreateParser(MemoryBlock *, MemoryBlock *, Lexer *);
+void    ContinueParser(Parser *);
 
-typedef Expression ExpressionParser(Parser *);
+void ReadToken(Parser *);
+void ExpectToken(Parser *, TokenType);
 
-Expression *ParseExpression(Parser *, Precedence);
-Expression  ParseLiteralExpression(Parser *);
-Expression  ParseStringLiteral(Parser *);
-Expression  ParseIntegerLiteral(Parser *);
+int PoolConstant(Ast *, Constant **, int, Value);
+
+void PrintStatement(Ast *, Statement *);
+void PrintExpression(Ast *, int);
+
+Ast      *Parse(Parser *);
+Statement ParseStatement(Parser *);
+Statement ParseExpressionStatement(Parser *);
+Statement ParseLetStatement(Parser *);
+Statement ParseReturnStatement(Parser *);
+Statement ParseProcStatement(Parser *);
+int       ParseBlockStatement(Parser *);
+void      ParseSkippedBlock(Parser *, int);
+void      ParseSkippedBlocks(Parser *);
+
+int ParseExpression(Parser *, Precedence);
+int ParseCallExpression(Parser *);
+int ParseLiteralExpression(Parser *);
+int ParseStringLiteral(Parser *);
+int ParseIntegerLiteral(Parser *);
 
 #endif /* !parse_h */
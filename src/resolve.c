@@ -0,0 +1,274 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "resolve.h"
+#include "stb_ds.h"
+
+typedef struct {
+	int key;   /* symbol */
+	int value; /* slot */
+	int proc;  /* statement, if a proc is the only binding, or -1 */
+} Binding;
+
+typedef struct {
+	Ast      *ast;
+	Binding **scopes;     /* of the proc bodies around the block, innermost on top */
+	int       mismatches; /* calls with the wrong number of arguments */
+	bool      check;      /* only count mismatches, names are left unbound */
+} Resolver;
+
+static int
+BoundName(Statement *statement)
+{
+	switch (statement->type) {
+	case STAT_LET: return statement->let.identifier;
+	case STAT_PROC: return statement->proc.identifier;
+	default: return -1;
+	}
+}
+
+/* Parameters take the first slots in order, so arguments are stored by
+ * position. The last of equally named parameters is the one bound */
+static Binding *
+Scope(Ast *ast, Statement *proc)
+{
+	BlockStatement *body  = &ast->blocks[proc->proc.body];
+	Binding        *scope = NULL;
+	Binding        *binding;
+	int             slots = proc->arity;
+	int             i, symbol;
+
+	for (i = 0; i < proc->arity; i++) {
+		symbol = ast->lists[proc->proc.arguments + i];
+		hmputs(scope, ((Binding){symbol, i, -1}));
+	}
+
+	for (i = body->first; i < body->first + body->count; i++) {
+		symbol = BoundName(&ast->statements[i]);
+		if (symbol < 0) continue;
+
+		if ((binding = hmgetp_null(scope, symbol))) binding->proc = -1;
+		else hmputs(scope, ((Binding){symbol, slots++, ast->statements[i].type == STAT_PROC ? i : -1}));
+	}
+
+	if (slots > SHRT_MAX) {
+		fprintf(stderr, "Too many names in proc %s\n", SymbolName(ast->symbols, proc->proc.identifier));
+		exit(200);
+	}
+	body->locals = slots;
+
+	return scope;
+}
+
+/* The proc statement in `block` whose body is `body` */
+static Statement *
+FindProc(Ast *ast, int block, int body)
+{
+	BlockStatement parent = ast->blocks[block];
+	int            i;
+
+	for (i = parent.first; i < parent.first + parent.count; i++) {
+		if (ast->statements[i].type == STAT_PROC && ast->statements[i].proc.body == body)
+			return &ast->statements[i];
+	}
+	return NULL;
+}
+
+static void
+Bind(Resolver *resolver, IdentifierExpression *identifier)
+{
+	int count = arrlen(resolver->scopes);
+	int depth, i;
+
+	for (depth = 0; depth < count; depth++) {
+		Binding *scope = resolver->scopes[count - 1 - depth];
+
+		if ((i = hmgeti(scope, identifier->symbol)) >= 0) {
+			identifier->depth = depth;
+			identifier->slot  = scope[i].value;
+			return;
+		}
+	}
+	identifier->depth = SCOPE_GLOBAL;
+}
+
+/* A call of a name that only a proc binds goes straight to the proc, even
+ * before the proc statement has run. Other names hold whatever they were
+ * given and are looked up when the call is made */
+static void
+Link(Resolver *resolver, int index)
+{
+	Ast                 *ast        = resolver->ast;
+	Expression          *call       = &ast->expressions[index];
+	Expression          *callee     = &ast->expressions[call->call.callee];
+	IdentifierExpression identifier = callee->identifier;
+	int                  count      = arrlen(resolver->scopes);
+	int                  statement  = -1;
+	int                  row, column;
+
+	if (identifier.depth == SCOPE_UNRESOLVED) Bind(resolver, &identifier);
+	if (identifier.depth == SCOPE_GLOBAL) {
+		if (identifier.symbol < arrlen(ast->globals)) statement = ast->globals[identifier.symbol];
+	} else {
+		statement = hmgets(resolver->scopes[count - 1 - identifier.depth], identifier.symbol).proc;
+	}
+	if (statement < 0) return;
+
+	if (ast->statements[statement].arity != call->arity) {
+		GetPosition(ast->tokens, ast->tokens->offsets[call->token], &row, &column);
+		fprintf(stderr, "Arity mismatch: %s takes %d arguments, not %d\n",
+		        SymbolName(ast->symbols, identifier.symbol), ast->statements[statement].arity,
+		        call->arity);
+		fprintf(stderr, "At line %d\n", row);
+		resolver->mismatches++;
+		return;
+	}
+	if (resolver->check) return;
+
+	*callee = (Expression){.type      = EXPR_PROCEDURE,
+	                       .token     = callee->token,
+	                       .procedure = {statement, identifier.depth}};
+}
+
+/* Names the optimizer copied in from elsewhere are already bound */
+static void
+ResolveExpression(Resolver *resolver, int index)
+{
+	Ast        *ast        = resolver->ast;
+	Expression *expression = &ast->expressions[index];
+	int         i;
+
+	switch (expression->type) {
+	case EXPR_IDENTIFIER:
+		if (expression->identifier.depth == SCOPE_UNRESOLVED && !resolver->check)
+			Bind(resolver, &expression->identifier);
+		break;
+	case EXPR_CALL:
+		ResolveExpression(resolver, expression->call.callee);
+		for (i = 0; i < expression->arity; i++)
+			ResolveExpression(resolver, ast->lists[expression->call.arguments + i]);
+		Link(resolver, index);
+		break;
+	case EXPR_PREFIX: ResolveExpression(resolver, expression->prefix.value); break;
+	case EXPR_INFIX:
+		ResolveExpression(resolver, expression->infix.value1);
+		ResolveExpression(resolver, expression->infix.value2);
+		break;
+	case EXPR_SHARED:
+		if (expression->shared.value >= 0) ResolveExpression(resolver, expression->shared.value);
+		break;
+	default: break;
+	}
+}
+
+/* Skipped bodies are resolved once they are parsed, from their parent */
+static void
+ResolveBlock(Resolver *resolver, int block)
+{
+	Ast            *ast   = resolver->ast;
+	BlockStatement  body  = ast->blocks[block];
+	Binding        *scope = arrlen(resolver->scopes) ? arrlast(resolver->scopes) : NULL;
+	Statement      *statement;
+	int             i;
+
+	for (i = body.first; i < body.first + body.count; i++) {
+		statement = &ast->statements[i];
+
+		switch (statement->type) {
+		case STAT_EXPR: ResolveExpression(resolver, statement->expression.expression); break;
+		case STAT_RETURN: ResolveExpression(resolver, statement->return_.value); break;
+		case STAT_LET:
+			ResolveExpression(resolver, statement->let.value);
+			if (scope) statement->slot = hmget(scope, statement->let.identifier);
+			break;
+		case STAT_PROC:
+			if (scope) statement->slot = hmget(scope, statement->proc.identifier);
+			ast->blocks[statement->proc.body].parent = block;
+			if (ast->blocks[statement->proc.body].first < 0) break;
+
+			arrpush(resolver->scopes, Scope(ast, statement));
+			ResolveBlock(resolver, statement->proc.body);
+			arrpop(resolver->scopes);
+			break;
+		default: break;
+		}
+	}
+}
+
+/* The procs bound once at the top level of a whole program are kept for
+ * the bodies that are parsed later. Lines of the REPL can bind any name
+ * again, so only names inside procs are linked there */
+static void
+FindGlobals(Ast *ast)
+{
+	BlockStatement program = ast->blocks[ast->program];
+	int            symbols = arrlen(ast->symbols->names);
+	MemoryBlock   *outer   = SetArrayArena(ast->parser->arena);
+	int            i, symbol;
+
+	arrsetlen(ast->globals, symbols);
+	for (i = 0; i < symbols; i++) ast->globals[i] = -1;
+
+	/* -2 for names bound by a let or more than once */
+	for (i = program.first; i < program.first + program.count; i++) {
+		symbol = BoundName(&ast->statements[i]);
+		if (symbol < 0) continue;
+
+		ast->globals[symbol] = ast->globals[symbol] == -1 && ast->statements[i].type == STAT_PROC ? i : -2;
+	}
+
+	SetArrayArena(outer);
+}
+
+void
+Resolve(Ast *ast, int block, bool program)
+{
+	Resolver     resolver = {.ast = ast};
+	MemoryBlock *scratch, *outer;
+	Binding     *scope;
+	long         mark;
+	int          body, parent, count, i;
+
+	if (ast->image || ast->blocks[block].first < 0) return;
+	if (program) FindGlobals(ast);
+
+	scratch = ast->parser->scratch;
+	mark    = ArenaMark(scratch);
+	outer   = SetArrayArena(scratch);
+
+	/* a body parsed on its first call is inside procs resolved before */
+	for (body = block; (parent = ast->blocks[body].parent) >= 0; body = parent)
+		arrpush(resolver.scopes, Scope(ast, FindProc(ast, parent, body)));
+
+	count = arrlen(resolver.scopes);
+	for (i = 0; i < count / 2; i++) {
+		scope                          = resolver.scopes[i];
+		resolver.scopes[i]             = resolver.scopes[count - 1 - i];
+		resolver.scopes[count - 1 - i] = scope;
+	}
+
+	ResolveBlock(&resolver, block);
+
+	SetArrayArena(outer);
+	ArenaReset(scratch, mark);
+
+	if (resolver.mismatches) exit(200);
+}
+
+void
+CheckArity(Ast *ast)
+{
+	Resolver     resolver = {.ast = ast, .check = true};
+	MemoryBlock *scratch  = ast->parser->scratch;
+	long         mark     = ArenaMark(scratch);
+	MemoryBlock *outer    = SetArrayArena(scratch);
+
+	FindGlobals(ast);
+	ResolveBlock(&resolver, ast->program);
+
+	SetArrayArena(outer);
+	ArenaReset(scratch, mark);
+
+	if (resolver.mismatches) exit(200);
+}
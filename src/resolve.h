@@ -0,0 +1,18 @@
+#ifndef resolve_h
+#define resolve_h
+
+#include "parse.h"
+
+/* Binds every name in an optimized block to the slot it is stored in, so
+ * that evaluating it is an index instead of a lookup. A name refers to the
+ * innermost proc around it that binds it, by parameter, let or proc
+ * anywhere in its body, and to a global otherwise. Calls are linked to
+ * their procs where that is known, see Link, and a block given as
+ * `program` is the whole program */
+void Resolve(Ast *, int, bool);
+
+/* Reports the calls of the whole program that Resolve would, without
+ * binding anything, for procs that are dropped before it runs */
+void CheckArity(Ast *);
+
+#endif /* !resolve_h */
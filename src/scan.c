@@ -0,0 +1,228 @@
+#include <ctype.h>
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+static int
+ScalarSpace(char *s, int n)
+{
+	int i;
+	for (i = 0; i < n && isspace((unsigned char)s[i]); i++);
+	return i;
+}
+
+static int
+ScalarWord(char *s, int n)
+{
+	int i;
+	for (i = 0; i < n && isalnum((unsigned char)s[i]); i++);
+	return i;
+}
+
+static int
+ScalarDigits(char *s, int n)
+{
+	int i;
+	for (i = 0; i < n && isdigit((unsigned char)s[i]); i++);
+	return i;
+}
+
+static int
+ScalarUntil(char *s, int n, char c)
+{
+	int i;
+	for (i = 0; i < n && s[i] != c; i++);
+	return i;
+}
+
+#ifdef SCAN_X86
+
+/* Bytes above 0x7F compare as negative, which keeps them out of every class
+ * just like isspace/isalnum do in the C locale */
+
+__attribute__((target("sse2"))) static unsigned
+Sse2SpaceMask(__m128i c)
+{
+	__m128i blank   = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+	__m128i control = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)),
+	                                _mm_cmpgt_epi8(_mm_set1_epi8('\r' + 1), c));
+	return _mm_movemask_epi8(_mm_or_si128(blank, control));
+}
+
+__attribute__((target("sse2"))) static unsigned
+Sse2DigitMask(__m128i c)
+{
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+	                                       _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c)));
+}
+
+__attribute__((target("sse2"))) static unsigned
+Sse2AlphaMask(__m128i c)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+	                                       _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower)));
+}
+
+__attribute__((target("sse2"))) static int
+Sse2Space(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		outside = ~Sse2SpaceMask(_mm_loadu_si128((__m128i *)(s + i))) & 0xFFFF;
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + ScalarSpace(s + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+Sse2Word(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i c = _mm_loadu_si128((__m128i *)(s + i));
+
+		outside = ~(Sse2AlphaMask(c) | Sse2DigitMask(c)) & 0xFFFF;
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + ScalarWord(s + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+Sse2Digits(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		outside = ~Sse2DigitMask(_mm_loadu_si128((__m128i *)(s + i))) & 0xFFFF;
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + ScalarDigits(s + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+Sse2Until(char *s, int n, char c)
+{
+	__m128i  needle = _mm_set1_epi8(c);
+	unsigned found;
+	int      i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		found = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(s + i)), needle));
+		if (found) return i + __builtin_ctz(found);
+	}
+	return i + ScalarUntil(s + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) static unsigned
+Avx2SpaceMask(__m256i c)
+{
+	__m256i blank   = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+	__m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)),
+	                                   _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c));
+	return _mm256_movemask_epi8(_mm256_or_si256(blank, control));
+}
+
+__attribute__((target("avx2"))) static unsigned
+Avx2DigitMask(__m256i c)
+{
+	return _mm256_movemask_epi8(
+		_mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+	                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c)));
+}
+
+__attribute__((target("avx2"))) static unsigned
+Avx2AlphaMask(__m256i c)
+{
+	__m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	return _mm256_movemask_epi8(
+		_mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+	                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower)));
+}
+
+__attribute__((target("avx2"))) static int
+Avx2Space(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		outside = ~Avx2SpaceMask(_mm256_loadu_si256((__m256i *)(s + i)));
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + Sse2Space(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+Avx2Word(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i c = _mm256_loadu_si256((__m256i *)(s + i));
+
+		outside = ~(Avx2AlphaMask(c) | Avx2DigitMask(c));
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + Sse2Word(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+Avx2Digits(char *s, int n)
+{
+	unsigned outside;
+	int      i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		outside = ~Avx2DigitMask(_mm256_loadu_si256((__m256i *)(s + i)));
+		if (outside) return i + __builtin_ctz(outside);
+	}
+	return i + Sse2Digits(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+Avx2Until(char *s, int n, char c)
+{
+	__m256i  needle = _mm256_set1_epi8(c);
+	unsigned found;
+	int      i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		found = _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(s + i)), needle));
+		if (found) return i + __builtin_ctz(found);
+	}
+	return i + Sse2Until(s + i, n - i, c);
+}
+
+#endif /* SCAN_X86 */
+
+static Scanner scalar = {ScalarSpace, ScalarWord, ScalarDigits, ScalarUntil};
+
+#ifdef SCAN_X86
+static Scanner sse2 = {Sse2Space, Sse2Word, Sse2Digits, Sse2Until};
+static Scanner avx2 = {Avx2Space, Avx2Word, Avx2Digits, Avx2Until};
+#endif
+
+/* Picks the widest scanner the CPU supports */
+Scanner *
+GetScanner()
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return &avx2;
+	if (__builtin_cpu_supports("sse2")) return &sse2;
+#endif
+	return &scalar;
+}
@@ -0,0 +1,18 @@
+#ifndef scan_h
+#define scan_h
+
+/* Character class scanners for the lexer. Each of them looks at no more than
+ * the first `n` bytes of `s` and returns how many of them belong to the class,
+ * working 16 or 32 bytes at a time where the CPU allows it */
+typedef struct {
+	int (*space)(char *s, int n);
+	/* letters and digits */
+	int (*word)(char *s, int n);
+	int (*digits)(char *s, int n);
+	/* anything up to the first `c` */
+	int (*until)(char *s, int n, char c);
+} Scanner;
+
+Scanner *GetScanner();
+
+#endif /* !scan_h */
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "arena.h"
+#include "stb_ds.h"
+
+#include "symbol.h"
+
+#define SYMBOLS_INITIAL 256
+
+static unsigned
+Hash(char *name, int length)
+{
+	unsigned hash = 2166136261u;
+	int      i;
+
+	for (i = 0; i < length; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	return hash;
+}
+
+static void
+AllocateSlots(SymbolTable *table, int capacity)
+{
+	table->capacity = capacity;
+	table->slots    = ArenaAlloc(table->arena, capacity * sizeof(int));
+	table->hashes   = ArenaAlloc(table->arena, capacity * sizeof(unsigned));
+	memset(table->slots, 0, capacity * sizeof(int));
+}
+
+SymbolTable *
+CreateSymbolTable(MemoryBlock *arena)
+{
+	SymbolTable *table = ArenaAlloc(arena, sizeof(SymbolTable));
+
+	*table = (SymbolTable){.arena = arena};
+	AllocateSlots(table, SYMBOLS_INITIAL);
+
+	return table;
+}
+
+/* Returns the slot holding `name`, or the empty slot where it belongs */
+static int
+Probe(SymbolTable *table, char *name, int length, unsigned hash)
+{
+	int   slot = hash & (table->capacity - 1);
+	char *candidate;
+
+	while (table->slots[slot]) {
+		candidate = table->names[table->slots[slot] - 1];
+		if (table->hashes[slot] == hash && strncmp(candidate, name, length) == 0 &&
+		    candidate[length] == '\0')
+			break;
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	return slot;
+}
+
+static void
+Grow(SymbolTable *table)
+{
+	int      *slots    = table->slots;
+	unsigned *hashes   = table->hashes;
+	int       capacity = table->capacity;
+	int       i, slot;
+
+	/* the old slots are left to the arena */
+	AllocateSlots(table, capacity * 2);
+
+	for (i = 0; i < capacity; i++) {
+		if (!slots[i]) continue;
+
+		slot = hashes[i] & (table->capacity - 1);
+		while (table->slots[slot]) slot = (slot + 1) & (table->capacity - 1);
+
+		table->slots[slot]  = slots[i];
+		table->hashes[slot] = hashes[i];
+	}
+}
+
+/* Returns the id of the `length` bytes at `name`, which do not have to be
+ * terminated, adding them to the table the first time they are seen */
+int
+Intern(SymbolTable *table, char *name, int length)
+{
+	unsigned     hash = Hash(name, length);
+	int          slot = Probe(table, name, length, hash);
+	char        *copy;
+	MemoryBlock *outer;
+
+	if (table->slots[slot]) return table->slots[slot] - 1;
+
+	copy = ArenaAlloc(table->arena, length + 1);
+	memcpy(copy, name, length);
+	copy[length] = '\0';
+
+	outer = SetArrayArena(table->arena);
+	arrpush(table->names, copy);
+	SetArrayArena(outer);
+
+	table->slots[slot]  = arrlen(table->names);
+	table->hashes[slot] = hash;
+
+	if (arrlen(table->names) * 2 > table->capacity) Grow(table);
+
+	return arrlen(table->names) - 1;
+}
+
+/* Like Intern, but returns -1 instead of adding unknown names */
+int
+FindSymbol(SymbolTable *table, char *name, int length)
+{
+	int slot = Probe(table, name, length, Hash(name, length));
+	return table->slots[slot] ? table->slots[slot] - 1 : -1;
+}
+
+char *
+SymbolName(SymbolTable *table, int symbol)
+{
+	return table->names[symbol];
+}
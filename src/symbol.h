@@ -0,0 +1,22 @@
+#ifndef symbol_h
+#define symbol_h
+
+#include "arena.h"
+
+/* Interns identifiers, so that every distinct name is stored once and known
+ * everywhere else by its id */
+typedef struct {
+	MemoryBlock *arena;
+	char       **names;    /* id -> terminated name */
+	int         *slots;    /* open addressing, id + 1 or 0 when empty */
+	unsigned    *hashes;   /* hash of the name in each slot */
+	int          capacity; /* power of two */
+} SymbolTable;
+
+SymbolTable *CreateSymbolTable(MemoryBlock *);
+
+int   Intern(SymbolTable *, char *, int);
+int   FindSymbol(SymbolTable *, char *, int);
+char *SymbolName(SymbolTable *, int);
+
+#endif /* !symbol_h */
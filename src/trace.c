@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+unsigned char trace_levels[TRACE_CATEGORIES];
+
+static char *TraceNames[] = {
+	[TRACE_LEX]   = "lex",
+	[TRACE_PARSE] = "parse",
+	[TRACE_OPT]   = "opt",
+	[TRACE_EVAL]  = "eval",
+	[TRACE_CALL]  = "call",
+};
+
+/* Enables the categories of a comma separated list like "lex,call:2", where
+ * "all" stands for every category and the level defaults to TRACE_BRIEF.
+ * Returns 0 on success, -1 if the list names an unknown category */
+int
+SetTrace(char *list)
+{
+	int   category, level, length;
+	char *end;
+
+	while (*list) {
+		length = strcspn(list, ":,");
+		level  = TRACE_BRIEF;
+
+		for (category = 0; category < TRACE_CATEGORIES; category++) {
+			if (strlen(TraceNames[category]) == length &&
+			    strncmp(TraceNames[category], list, length) == 0)
+				break;
+		}
+		if (category == TRACE_CATEGORIES &&
+		    !(length == 3 && strncmp(list, "all", 3) == 0))
+			return -1;
+
+		list += length;
+		if (*list == ':') {
+			level = strtol(list + 1, &end, 10);
+			if (end == list + 1) return -1;
+			list = end;
+		}
+
+		if (category < TRACE_CATEGORIES) trace_levels[category] = level;
+		else memset(trace_levels, level, sizeof(trace_levels));
+
+		if (*list == ',') list++;
+		else if (*list) return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef trace_h
+#define trace_h
+
+#include <stdio.h>
+
+/* Diagnostic output of the stages, written to stderr. Every category is off
+ * unless selected with --trace, and building with -DNO_TRACE removes the
+ * trace points altogether */
+typedef enum {
+	TRACE_LEX,   /* tokens as the parser reads them */
+	TRACE_PARSE, /* statements as they are parsed */
+	TRACE_OPT,   /* rewrites made by the optimizer */
+	TRACE_EVAL,  /* blocks as they are evaluated */
+	TRACE_CALL,  /* arguments and results of calls */
+	TRACE_CATEGORIES
+} TraceCategory;
+
+enum { TRACE_OFF, TRACE_BRIEF, TRACE_VERBOSE };
+
+extern unsigned char trace_levels[TRACE_CATEGORIES];
+
+#ifdef NO_TRACE
+#define TRACING(category, level) 0
+#else
+#define TRACING(category, level) (trace_levels[category] >= (level))
+#endif
+
+#define TRACE(category, level, ...) \
+	do { \
+		if (TRACING(category, level)) fprintf(stderr, __VA_ARGS__); \
+	} while (0)
+
+int SetTrace(char *);
+
+#endif /* !trace_h */
@@ -1,35 +1,69 @@
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "utils.h"
 
 static int indent;
 
-long
-GetFileSize(FILE *file)
+/* Maps a regular file read-only. The mapping is followed by at least one
+ * zero byte, which terminates the source without copying it. Returns NULL
+ * for anything that cannot be mapped, like pipes and terminals */
+char *
+MapFile(char *path, long *size)
 {
-	long pos, size;
+	struct stat info;
+	char       *buf;
+	int         fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	*size = info.st_size;
+
+	/* reserve an extra byte of anonymous zeroes and lay the file over the
+	 * beginning; a partial last page of the file is zero filled anyway */
+	buf = mmap(NULL, *size + 1, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (buf != MAP_FAILED && *size &&
+	    mmap(buf, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(buf, *size + 1);
+		buf = MAP_FAILED;
+	}
+	close(fd);
+
+	if (buf == MAP_FAILED) return NULL;
 
-	pos = ftell(file);
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	fseek(file, pos, SEEK_SET);
+	madvise(buf, *size, MADV_SEQUENTIAL);
+	return buf;
+}
 
-	return size;
+void
+UnmapFile(char *buf, long size)
+{
+	munmap(buf, size + 1);
 }
 
+/* Reads a stream of unknown length, e.g. stdin or a pipe, up to its end */
 char *
-ReadFile(FILE *file)
+ReadFile(FILE *file, long *size)
 {
-	char *buf;
-	long  size;
+	long  capacity = 1 << 16;
+	char *buf      = malloc(capacity);
+	long  count;
 
-	size      = GetFileSize(file);
-	buf       = malloc(size + 1);
-	buf[size] = '\0';
-	fread(buf, 1, size, file);
+	*size = 0;
+	while ((count = fread(buf + *size, 1, capacity - *size - 1, file)) > 0) {
+		*size += count;
+		if (*size == capacity - 1) buf = realloc(buf, capacity *= 2);
+	}
+	buf[*size] = '\0';
 	fclose(file);
 
 	return buf;
@@ -55,6 +89,6 @@ Print(char *string, ...)
 
 	va_list args;
 	va_start(args, string);
-	vprintf(buf, args);
+	vfprintf(stderr, buf, args);
 	va_end(args);
 }
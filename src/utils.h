@@ -5,8 +5,9 @@
 
 #define len(a) (sizeof(a) / sizeof(a[0]))
 
-long  GetFileSize(FILE *file);
-char *ReadFile(FILE *file);
+char *MapFile(char *path, long *size);
+void  UnmapFile(char *buf, long size);
+char *ReadFile(FILE *file, long *size);
 
 void Print(char *, ...);
 void BeginIndent();